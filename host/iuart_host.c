@@ -0,0 +1,51 @@
+/*
+** @file iuart_host.c
+*/
+
+/*	Storage behind the iuart_hw.h shim for host builds of the driver: the
+	variables standing in for the registers, and the table holding the
+	stdio streams' user data. Linked with iuart.c and the harness, see
+	the Makefile; iuart.c itself only has target code. */
+
+
+#include "iuart_hw.h"
+
+volatile uint8_t iuart_host_usart[4][8];
+volatile uint8_t iuart_host_tccr1a, iuart_host_tccr1b;
+volatile uint8_t iuart_host_timsk1, iuart_host_tifr1;
+volatile uint16_t iuart_host_tcnt1, iuart_host_ocr1b, iuart_host_icr1;
+volatile uint8_t iuart_host_gpio[3][3];
+volatile uint8_t iuart_host_pcicr, iuart_host_pcmsk[3];
+volatile uint8_t iuart_host_sreg = _BV(SREG_I);
+volatile uint8_t iuart_host_smcr;
+
+static struct
+{
+	FILE *stream;
+	void *udata;
+} iuart_host_streams[IUART_HOST_STREAMS];
+
+void *iuart_host_get_udata(FILE *stream)
+{
+	uint8_t i;
+
+	for (i = 0; i < IUART_HOST_STREAMS; i++)
+		if (iuart_host_streams[i].stream == stream)
+			return iuart_host_streams[i].udata;
+	return (void *)0;
+}
+
+// Takes the stream's slot, or a free one; streams beyond IUART_HOST_STREAMS
+// keep a NULL user data, which is port 0
+void iuart_host_set_udata(FILE *stream, void *udata)
+{
+	uint8_t i;
+
+	for (i = 0; i < IUART_HOST_STREAMS; i++)
+		if (iuart_host_streams[i].stream == stream || !iuart_host_streams[i].stream)
+		{
+			iuart_host_streams[i].stream = stream;
+			iuart_host_streams[i].udata = udata;
+			return;
+		}
+}
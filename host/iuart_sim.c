@@ -0,0 +1,1354 @@
+/*
+** @file iuart_sim.c
+*/
+
+/*	Host simulation of USART0 and Timer1 for the interrupt driven UART,
+	with the checks and the benchmark run on it.
+
+	iuart.c is built for the host against the iuart_hw.h shim, see the
+	Makefile, and this file plays the hardware: it moves the bytes the
+	driver writes to UDR0 out through a shift register taking one frame
+	time each at the baud rate programmed in UBRR0, feeds queued input
+	into UDR0 at the line rate, runs Timer1 and the interrupt handlers
+	when they are due and interrupts are enabled, and lets simulated
+	time pass when the driver sleeps.
+
+	usage: iuart_sim                  run the checks of the features built in
+	       iuart_sim -b [capture]     benchmark, replaying capture (raw bytes)
+
+	The benchmark sends and receives the traffic through UART0_Putchar()
+	and uart_getchar() at several baud rates and reports the simulated
+	line throughput, which shows any gap the driver leaves between bytes,
+	the host cycles the driver took per byte, and its worst-case ISR
+	latency: the longest stretch with interrupts disabled plus the
+	longest handler. Host figures are for comparing builds on one
+	machine, not AVR cycle counts. */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined (__x86_64__) || defined (__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "iuart_hw.h"
+#include "iuart.h"
+
+void iuart_host_usart0_rx_vect(void);
+void iuart_host_usart0_udre_vect(void);
+void iuart_host_usart0_tx_vect(void);
+#if IUART_RTU
+void iuart_host_timer1_compb_vect(void);
+#endif
+#if IUART_AUTOBAUD
+void iuart_host_timer1_capt_vect(void);
+void iuart_host_timer1_ovf_vect(void);
+#endif
+#if IUART_FLOW_CONTROL
+void IUART_CTS_vect(void);
+#endif
+
+#define SIM_QUEUE_SIZE		65536		// bytes of input or output held, a power of two
+#define SIM_BIT9			0x01		// with the status of queued input: the 9th bit is set
+
+//********************************
+//       HOST TIMING
+//********************************
+
+#if defined (__x86_64__) || defined (__i386__)
+#define HOST_UNIT			"cycles"
+static inline uint64_t host_clock(void)
+{
+	return __rdtsc();
+}
+#else
+#define HOST_UNIT			"ns"
+static inline uint64_t host_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
+
+// Host time the driver takes. The harness keeps its own time out of the
+// totals, and records how long each interrupts-off window and each handler
+// run took, in the order they happen. A benchmark run plays out the same
+// every time, so repeating it and keeping the shortest time seen for each
+// of them leaves out the times the host preempted us.
+#define HOST_WINDOWS		(1UL << 18)
+
+typedef struct
+{
+	uint32_t n;					// windows in this run
+	uint32_t min[HOST_WINDOWS];	// shortest time of each in the runs so far
+} host_windows_t;
+
+static uint64_t host_harness;	// spent in the hooks, not counting the handlers they ran
+static uint64_t host_irq_off;	// when the driver last disabled interrupts, 0 = enabled
+static host_windows_t host_irq_off_windows, host_isr_windows;
+static uint8_t host_first_run = 1;
+
+static void host_window(host_windows_t *w, uint64_t t)
+{
+	if (t > UINT32_MAX)
+		t = UINT32_MAX;
+	if (w->n < HOST_WINDOWS && (host_first_run || t < w->min[w->n]))
+		w->min[w->n] = t;
+	w->n++;
+}
+
+static uint32_t host_window_max(const host_windows_t *w)
+{
+	uint32_t i, max = 0;
+
+	for (i = 0; i < w->n && i < HOST_WINDOWS; i++)
+		if (w->min[i] > max)
+			max = w->min[i];
+	return max;
+}
+
+//********************************
+//       SIMULATED HARDWARE
+//********************************
+
+static uint64_t sim_now;		// simulated time, in CPU cycles
+
+// Transmitter: UDR0 and the shift register behind it
+static uint8_t sim_udr_full, sim_udr, sim_udr9;
+static uint64_t sim_shift_end;	// when the byte being shifted out is done, 0 = idle
+static uint8_t sim_shift, sim_shift9;
+static uint8_t sim_txc;
+static uint8_t sim_loopback;	// bytes sent are received again, as with TXD wired to RXD
+static uint32_t sim_tx_seen;	// the driver's count of bytes sent, as last seen
+
+// Everything sent, in order, with the 9th bit of each
+static uint8_t wire[SIM_QUEUE_SIZE], wire9[SIM_QUEUE_SIZE];
+static uint32_t wire_len;
+
+// Receiver: the queued input, each byte with the time its stop bit is in
+static struct
+{
+	uint8_t c;
+	uint8_t status;				// FE0, UPE0 to report with it, SIM_BIT9
+	uint64_t at;
+} rx_queue[SIM_QUEUE_SIZE];
+static uint32_t rx_head, rx_tail;
+static uint8_t sim_rxc, sim_rx_byte, sim_rx_status, sim_rx_bit9;
+static uint32_t sim_overruns;
+
+// Timer1
+static uint64_t sim_timer_ticks;
+static uint32_t sim_timer_rest;	// cycles towards the next tick
+static uint8_t sim_ocf1b, sim_icf1, sim_tov1;
+static uint8_t sim_tifr1;		// TIFR1 as last set here, to tell the driver's writes
+
+// Falling edges on ICP1, wired to RXD, with the time of each
+static uint64_t icp_queue[SIM_QUEUE_SIZE];
+static uint32_t icp_head, icp_tail;
+
+// Pin change interrupt of CTS, the only pin the harness drives
+static uint8_t sim_pcif;
+
+static uint8_t sim_in_isr, sim_woken;
+
+// Cycles of one frame at the rate and format the driver programmed
+static uint32_t sim_frame_cycles(void)
+{
+	uint16_t ubrr = (UBRR0H << 8) | UBRR0L;
+	uint8_t bits = 1 + 5 + ((UCSR0C >> UCSZ00) & 3) + 1;
+
+	if (UCSR0B & _BV(UCSZ02))
+		bits++;
+	if (UCSR0C & _BV(UPM01))
+		bits++;
+	if (UCSR0C & _BV(USBS0))
+		bits++;
+	return (uint32_t)(UCSR0A & _BV(U2X0) ? 8 : 16) * (ubrr + 1) * bits;
+}
+
+static uint16_t sim_timer_prescale(void)
+{
+	static const uint16_t prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+
+	return prescale[TCCR1B & 7];
+}
+
+// A flag in TIFR1 is cleared by writing a one to it, which shows here as a
+// value other than the one last set. A write of exactly the flags set goes
+// unnoticed, which the driver's writes of flags it owns never are at once.
+static void sim_tifr1_sync(void)
+{
+	if (TIFR1 != sim_tifr1) {
+		if (TIFR1 & _BV(ICF1))
+			sim_icf1 = 0;
+		if (TIFR1 & _BV(TOV1))
+			sim_tov1 = 0;
+	}
+	sim_tifr1 = TIFR1 = (sim_icf1 ? _BV(ICF1) : 0) | (sim_tov1 ? _BV(TOV1) : 0);
+}
+
+// Cycles until Timer1 overflows, 0 if the overflow interrupt is off
+static uint64_t sim_overflow_in(void)
+{
+	uint16_t pre = sim_timer_prescale();
+
+	if (!pre || !(TIMSK1 & _BV(TOIE1)) || sim_tov1)
+		return 0;
+	return (65536 - (uint16_t)sim_timer_ticks) * (uint64_t)pre - sim_timer_rest;
+}
+
+// Cycles until Timer1 reaches OCR1B, 0 if the compare interrupt is off
+static uint64_t sim_compare_in(void)
+{
+	uint16_t pre = sim_timer_prescale();
+	uint32_t ticks;
+
+	if (!pre || !(TIMSK1 & _BV(OCIE1B)) || sim_ocf1b)
+		return 0;
+	ticks = (uint16_t)(OCR1B - (uint16_t)sim_timer_ticks);
+	if (ticks == 0)
+		ticks = 65536;
+	return (uint64_t)ticks * pre - sim_timer_rest;
+}
+
+static void sim_timer_advance(uint64_t cycles)
+{
+	uint16_t pre = sim_timer_prescale();
+	uint64_t compare = sim_compare_in();
+
+	uint64_t ticks = sim_timer_ticks;
+
+	if (!pre)
+		return;
+	if (compare && compare <= cycles)
+		sim_ocf1b = 1;
+	cycles += sim_timer_rest;
+	sim_timer_ticks += cycles / pre;
+	sim_timer_rest = cycles % pre;
+	TCNT1 = (uint16_t)sim_timer_ticks;
+	if (sim_timer_ticks >> 16 != ticks >> 16) {
+		sim_tifr1_sync();
+		sim_tov1 = 1;
+		sim_tifr1_sync();
+	}
+}
+
+// Runs one handler the way the CPU does, with interrupts disabled
+static void sim_run_isr(void (*isr)(void))
+{
+	uint64_t t;
+
+	sim_in_isr = 1;
+	iuart_host_sreg &= ~_BV(SREG_I);
+	t = host_clock();
+	isr();
+	t = host_clock() - t;
+	iuart_host_sreg |= _BV(SREG_I);
+	sim_in_isr = 0;
+
+	host_harness -= t;
+	host_window(&host_isr_windows, t);
+	sim_woken = 1;
+}
+
+// Tells whether the UDRE handler wrote UDR0, from the driver's count; read
+// as if from a handler, so it neither runs interrupts nor counts as latency
+static uint32_t sim_tx_bytes(void)
+{
+	iuart_counters_t k;
+
+	sim_in_isr = 1;
+	iuart_get_counters(0, &k);
+	sim_in_isr = 0;
+	return k.tx_bytes;
+}
+
+// Moves UDR0 into the shift register once that is free, keeping as many
+// data bits as the frame has
+static void sim_tx_load(void)
+{
+	if (sim_udr_full && !sim_shift_end) {
+		sim_shift = sim_udr & (0xff >> (3 - ((UCSR0C >> UCSZ00) & 3)));
+		sim_shift9 = sim_udr9;
+		sim_udr_full = 0;
+		sim_shift_end = sim_now + sim_frame_cycles();
+	}
+}
+
+// Takes the byte the driver wrote to UDR0, the sent-th it counted
+static void sim_tx_write(uint32_t sent, uint8_t bit9)
+{
+	sim_tx_seen = sent;
+	sim_udr = UDR0;
+	sim_udr9 = bit9;
+	sim_udr_full = 1;
+	sim_txc = 0;
+	sim_tx_load();
+}
+
+// iuart_send_address() loads UDR0 itself, with interrupts disabled and
+// TXB80 set only until UDRE0 shows the byte moved on, so it is picked up
+// with its 9th bit as interrupts come back on. UDRE0 is kept up to date
+// for it to poll, whatever the driver last wrote to UCSR0A.
+static void sim_tx_direct(void)
+{
+	uint32_t sent = sim_tx_bytes();
+
+	if (sent != sim_tx_seen)
+		sim_tx_write(sent, (UCSR0B & _BV(UCSZ02)) != 0);
+	UCSR0A = (UCSR0A & ~_BV(UDRE0)) | (sim_udr_full ? 0 : _BV(UDRE0));
+}
+
+// Runs the handlers that are due, in the AVR's priority order, for as long
+// as interrupts are enabled and any is left
+static void sim_interrupts(void)
+{
+	uint32_t sent;
+
+	sim_tifr1_sync();
+	while (!sim_in_isr && (SREG & _BV(SREG_I))) {
+#if IUART_FLOW_CONTROL
+		if (sim_pcif && (PCICR & _BV(IUART_CTS_PCIE))) {
+			sim_pcif = 0;
+			sim_run_isr(IUART_CTS_vect);
+		} else
+#endif
+#if IUART_AUTOBAUD
+		if (sim_icf1 && (TIMSK1 & _BV(ICIE1))) {
+			sim_run_isr(iuart_host_timer1_capt_vect);
+			sim_icf1 = 0;
+			sim_tifr1_sync();
+		} else if (sim_tov1 && (TIMSK1 & _BV(TOIE1))) {
+			sim_run_isr(iuart_host_timer1_ovf_vect);
+			sim_tov1 = 0;
+			sim_tifr1_sync();
+		} else
+#endif
+		if (sim_rxc && (UCSR0B & _BV(RXCIE0))) {
+			UCSR0A = (UCSR0A & (_BV(U2X0) | _BV(MPCM0))) | _BV(RXC0) | sim_rx_status;
+			UCSR0B = (UCSR0B & ~_BV(RXB80)) | (sim_rx_bit9 ? _BV(RXB80) : 0);
+			UDR0 = sim_rx_byte;
+			sim_run_isr(iuart_host_usart0_rx_vect);
+			UCSR0A &= _BV(U2X0) | _BV(MPCM0);
+			sim_rxc = 0;
+			sim_rx_status = 0;
+		} else if (!sim_udr_full && (UCSR0B & _BV(UDRIE0))) {
+			sent = sim_tx_bytes();
+			sim_run_isr(iuart_host_usart0_udre_vect);
+			if (sim_tx_bytes() != sent)
+				sim_tx_write(sent + 1, (UCSR0B & _BV(UCSZ02)) && (UCSR0B & _BV(TXB80)));
+			else if (UCSR0B & _BV(UDRIE0)) {
+				fprintf(stderr, "iuart_sim: UDRE handler left UDRIE0 set and sent nothing\n");
+				exit(2);
+			}
+		} else if (sim_txc && (UCSR0B & _BV(TXCIE0))) {
+			sim_txc = 0;
+			sim_run_isr(iuart_host_usart0_tx_vect);
+#if IUART_RTU
+		} else if (sim_ocf1b && (TIMSK1 & _BV(OCIE1B))) {
+			sim_ocf1b = 0;
+			sim_run_isr(iuart_host_timer1_compb_vect);
+#endif
+		} else
+			break;
+	}
+}
+
+static void sim_rx_arrive(uint8_t c, uint8_t status)
+{
+	uint8_t bit9 = status & SIM_BIT9;
+
+	status &= ~SIM_BIT9;
+	if (!(UCSR0B & _BV(RXEN0)))
+		return;
+	if ((UCSR0B & _BV(UCSZ02)) && (UCSR0A & _BV(MPCM0)) && !bit9)
+		return;					// a data frame, which MPCM filters out
+	if (sim_rxc) {				// the last one is still in UDR0
+		sim_overruns++;
+		sim_rx_status |= _BV(DOR0);
+		return;
+	}
+	sim_rx_byte = c;
+	sim_rx_status |= status;
+	sim_rx_bit9 = bit9;
+	sim_rxc = 1;
+}
+
+// The next hardware event, in cycles from now, or 0 if none is coming
+static uint64_t sim_next_event(void)
+{
+	uint64_t next = 0, t;
+
+	if (sim_shift_end)
+		next = sim_shift_end - sim_now;
+	if (rx_head != rx_tail) {
+		t = rx_queue[rx_tail & (SIM_QUEUE_SIZE - 1)].at;
+		t = t > sim_now ? t - sim_now : 1;
+		if (!next || t < next)
+			next = t;
+	}
+	if (icp_head != icp_tail) {
+		t = icp_queue[icp_tail & (SIM_QUEUE_SIZE - 1)];
+		t = t > sim_now ? t - sim_now : 1;
+		if (!next || t < next)
+			next = t;
+	}
+	t = sim_compare_in();
+	if (t && (!next || t < next))
+		next = t;
+	t = sim_overflow_in();
+	if (t && (!next || t < next))
+		next = t;
+	return next;
+}
+
+// Lets up to cycles pass, running through the events on the way. Returns
+// 0 if nothing was left to happen.
+static int sim_step(uint64_t cycles)
+{
+	uint64_t next = sim_next_event();
+
+	if (!next || next > cycles) {
+		sim_timer_advance(cycles);
+		sim_now += cycles;
+		return next != 0;
+	}
+
+	sim_timer_advance(next);
+	sim_now += next;
+	if (sim_shift_end && sim_shift_end <= sim_now) {
+		wire9[wire_len & (SIM_QUEUE_SIZE - 1)] = sim_shift9;
+		wire[wire_len++ & (SIM_QUEUE_SIZE - 1)] = sim_shift;
+		sim_shift_end = 0;
+		if (sim_loopback && rx_head - rx_tail < SIM_QUEUE_SIZE) {
+			rx_queue[rx_head & (SIM_QUEUE_SIZE - 1)].c = sim_shift;
+			rx_queue[rx_head & (SIM_QUEUE_SIZE - 1)].status = sim_shift9 ? SIM_BIT9 : 0;
+			rx_queue[rx_head & (SIM_QUEUE_SIZE - 1)].at = sim_now;
+			rx_head++;
+		}
+		sim_tx_load();
+		if (!sim_shift_end)
+			sim_txc = 1;
+	}
+	while (rx_head != rx_tail && rx_queue[rx_tail & (SIM_QUEUE_SIZE - 1)].at <= sim_now) {
+		sim_rx_arrive(rx_queue[rx_tail & (SIM_QUEUE_SIZE - 1)].c,
+					  rx_queue[rx_tail & (SIM_QUEUE_SIZE - 1)].status);
+		rx_tail++;
+	}
+	while (icp_head != icp_tail && icp_queue[icp_tail & (SIM_QUEUE_SIZE - 1)] <= sim_now) {
+		if (sim_timer_prescale() && !(TCCR1B & _BV(ICES1))) {
+			ICR1 = (uint16_t)sim_timer_ticks;	// a capture still pending is lost
+			sim_icf1 = 1;
+			sim_tifr1_sync();
+		}
+		icp_tail++;
+	}
+	sim_interrupts();
+	return 1;
+}
+
+// Lets cycles pass with the CPU idle
+static void sim_idle(uint64_t cycles)
+{
+	uint64_t end = sim_now + cycles;
+
+	sim_interrupts();
+	while (sim_now < end)
+		sim_step(end - sim_now);
+}
+
+// Lets time pass until the line has been idle for a frame
+static void sim_drain(void)
+{
+	uint32_t frame = sim_frame_cycles();
+
+	sim_interrupts();
+	while (sim_udr_full || sim_shift_end || sim_txc || rx_head != rx_tail || sim_rxc ||
+		   (UCSR0B & _BV(UDRIE0)))
+		if (!sim_step(frame))
+			break;
+	sim_idle(frame);
+}
+
+// Queues input, each byte arriving one frame after the one before
+static void sim_receive(const void *data, uint32_t len, uint8_t status)
+{
+	const uint8_t *b = data;
+	uint64_t at = sim_now;
+
+	if (rx_head != rx_tail && rx_queue[(rx_head - 1) & (SIM_QUEUE_SIZE - 1)].at > at)
+		at = rx_queue[(rx_head - 1) & (SIM_QUEUE_SIZE - 1)].at;
+	while (len-- && rx_head - rx_tail < SIM_QUEUE_SIZE) {
+		at += sim_frame_cycles();
+		rx_queue[rx_head & (SIM_QUEUE_SIZE - 1)].c = *b++;
+		rx_queue[rx_head & (SIM_QUEUE_SIZE - 1)].status = status;
+		rx_queue[rx_head & (SIM_QUEUE_SIZE - 1)].at = at;
+		rx_head++;
+	}
+}
+
+#if IUART_AUTOBAUD
+// Puts data on RXD as the peer would send it at baud in 8N1, for ICP1 alone:
+// the receiver is left out, as if it were off
+static void sim_line_send(const void *data, uint32_t len, uint32_t baud)
+{
+	const uint8_t *b = data;
+	double bit = (double)F_CPU / baud, at = sim_now + bit;
+	uint16_t frame;
+	uint8_t k, level;
+
+	if (icp_head != icp_tail && icp_queue[(icp_head - 1) & (SIM_QUEUE_SIZE - 1)] > at)
+		at = icp_queue[(icp_head - 1) & (SIM_QUEUE_SIZE - 1)] + bit;
+	while (len--) {
+		frame = (uint16_t)(*b++ << 1 | 0x200);	// start bit, LSB first, stop bit
+		for (k = 0, level = 1; k < 10; k++, frame >>= 1) {
+			if (level && !(frame & 1) && icp_head - icp_tail < SIM_QUEUE_SIZE)
+				icp_queue[icp_head++ & (SIM_QUEUE_SIZE - 1)] = (uint64_t)(at + k * bit);
+			level = frame & 1;
+		}
+		at += 10 * bit;
+	}
+}
+#endif
+
+#if IUART_FLOW_CONTROL
+// Drives the peer's RTS, our CTS: off (high) pauses our output
+static void sim_cts(uint8_t off)
+{
+	if (!(IUART_CTS_PIN & _BV(IUART_CTS_BIT)) != !off) {
+		IUART_CTS_PIN ^= _BV(IUART_CTS_BIT);
+		if (IUART_CTS_PCMSK & _BV(IUART_CTS_PCINT))
+			sim_pcif = 1;
+	}
+	sim_interrupts();
+}
+#endif
+
+// Starts a check or a benchmark run from a freshly initialised port
+static void sim_reset(void)
+{
+	iuart_host_sreg = _BV(SREG_I);
+	host_harness = 0;
+	host_irq_off = 0;
+	host_irq_off_windows.n = host_isr_windows.n = 0;
+	sim_udr_full = sim_shift_end = sim_txc = sim_loopback = sim_tx_seen = 0;
+	sim_rxc = sim_rx_status = sim_ocf1b = sim_icf1 = sim_tov1 = sim_pcif = 0;
+	wire_len = rx_head = rx_tail = icp_head = icp_tail = sim_overruns = 0;
+	sim_tifr1_sync();
+#if IUART_FLOW_CONTROL
+	IUART_CTS_PIN &= ~_BV(IUART_CTS_BIT);
+#endif
+	iuart_init(0);
+}
+
+//********************************
+//       HOOKS
+//********************************
+
+// The driver sleeps: wakes it right away for any interrupt that is pending
+// or ran since it enabled interrupts, otherwise lets time pass up to the
+// next event, as the CPU would in idle sleep
+void iuart_host_sleep(void)
+{
+	uint64_t t = host_clock();
+
+	sim_interrupts();
+	if (!sim_woken && !sim_step(UINT64_MAX / 2)) {
+		fprintf(stderr, "iuart_sim: asleep with nothing left to wake up\n");
+		exit(2);
+	}
+	sim_woken = 0;
+	host_harness += host_clock() - t;
+}
+
+void iuart_host_set_sreg(uint8_t sreg)
+{
+	uint64_t t = host_clock();
+	uint8_t was = iuart_host_sreg;
+
+	iuart_host_sreg = sreg;
+	sim_tifr1_sync();
+	if (sim_in_isr)
+		return;
+	sim_tx_direct();
+	if ((was & _BV(SREG_I)) && !(sreg & _BV(SREG_I)))
+		host_irq_off = t;
+	else if (!(was & _BV(SREG_I)) && (sreg & _BV(SREG_I))) {
+		if (host_irq_off)
+			host_window(&host_irq_off_windows, t - host_irq_off);
+		host_irq_off = 0;
+		sim_woken = 0;			// only what runs from now on wakes a sleep
+	}
+	if (sreg & _BV(SREG_I))
+		sim_interrupts();
+	host_harness += host_clock() - t;
+}
+
+//********************************
+//       CHECKS
+//********************************
+
+static int failures;
+
+#define CHECK(cond, ...)														\
+	do {																		\
+		if (!(cond)) {															\
+			printf("FAIL %s:%d: ", __func__, __LINE__);							\
+			printf(__VA_ARGS__);												\
+			printf("\n");														\
+			failures++;															\
+		}																		\
+	} while (0)
+
+static int wire_is(const void *expect, uint32_t len)
+{
+	return wire_len == len && memcmp(wire, expect, len) == 0;
+}
+
+static void check_printf(void)
+{
+	sim_reset();
+	CHECK(iuart_printf(0, "%s=%d %04x\n", "v", -42, 0xbeef) == 11, "returned length");
+	CHECK(iuart_flush(0) == 0, "flush");
+	sim_drain();
+#if IUART_COOKED
+	CHECK(wire_is("v=-42 beef\r\n", 12), "got %u bytes", wire_len);
+#else
+	CHECK(wire_is("v=-42 beef\n", 11), "got %u bytes", wire_len);
+#endif
+	CHECK(!iuart_tx_busy(0), "still busy");
+
+	// fixed point on decimal conversions only, hex takes the C meaning
+	sim_reset();
+	CHECK(iuart_printf(0, "%.3x %.6x %.2d %.3u %5.2X", 0x1234, 0x1234, 1234, 5, 0xa) == 29,
+		  "returned length");
+	sim_drain();
+	CHECK(wire_is("1234 001234 12.34 0.005    0A", 29), "got %.*s", (int)wire_len, wire);
+}
+
+static void check_stdio(void)
+{
+	FILE *stream = fopen("/dev/null", "w");
+
+	sim_reset();
+	fdev_set_udata(stream, (void *)0);
+	CHECK(iuart_putchar('A', stream) == 0 && UART0_Putchar('B', stream) == 0, "putchar");
+	sim_drain();
+	CHECK(wire_is("AB", 2), "got %u bytes", wire_len);
+#if IUART_USE_USART1
+	iuart_init(1);
+	fdev_set_udata(stream, (void *)1);
+	CHECK(iuart_putchar('C', stream) == 0, "putchar on port 1");
+	sim_drain();
+	CHECK(wire_len == 2 && iuart_tx_busy(1), "stream user data ignored");
+#endif
+	fclose(stream);
+}
+
+static const char flash_text[] PROGMEM = "0123456789";
+
+static void check_policies(void)
+{
+	static uint8_t data[2 * UART_BUFFER_SIZE];
+	iuart_counters_t k;
+	size_t i, n;
+
+	for (i = 0; i < sizeof data; i++)
+		data[i] = i * 7;
+
+	sim_reset();
+	iuart_set_tx_policy(0, UART_TX_FAIL);
+	n = iuart_write(0, data, sizeof data);
+	CHECK(n >= UART_BUFFER_SIZE - 1 && n < sizeof data, "FAIL took %zu", n);
+	sim_drain();
+	CHECK(wire_is(data, n), "FAIL sent %u bytes", wire_len);
+
+#if !IUART_TX_BUFFERS
+	// flash output reports what FAIL dropped, as the header says
+	sim_reset();
+	iuart_set_tx_policy(0, UART_TX_FAIL);
+	iuart_write(0, data, UART_BUFFER_SIZE - 4);
+	CHECK(iuart_write_P(0, (const uint8_t *)flash_text, 2) == 0, "write_P failed with room");
+	CHECK(iuart_write_P(0, (const uint8_t *)flash_text, 10) == EOF, "write_P dropped nothing");
+	sim_drain();
+#endif
+
+	sim_reset();
+	iuart_set_tx_policy(0, UART_TX_BLOCK);
+	CHECK(iuart_write(0, data, sizeof data) == sizeof data, "BLOCK short");
+	sim_drain();
+	CHECK(wire_is(data, sizeof data), "BLOCK sent %u bytes", wire_len);
+
+	sim_reset();
+	iuart_set_tx_policy(0, UART_TX_DROP_OLDEST);
+	CHECK(iuart_write(0, data, sizeof data) == sizeof data, "DROP_OLDEST short");
+	sim_drain();
+	iuart_get_counters(0, &k);
+	CHECK(k.tx_overwritten > 0, "nothing overwritten");
+	CHECK(wire_len > UART_BUFFER_SIZE / 2 && wire_len < sizeof data &&
+		  memcmp(wire + wire_len - 16, data + sizeof data - 16, 16) == 0, "DROP_OLDEST sent %u bytes", wire_len);
+
+	// blocking sleeps in idle, then puts back the application's sleep mode
+	sim_reset();
+	iuart_set_tx_policy(0, UART_TX_BLOCK);
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	iuart_write(0, data, sizeof data);
+	iuart_flush(0);
+	CHECK(SMCR == SLEEP_MODE_PWR_DOWN, "sleep mode left at 0x%02x", SMCR);
+	set_sleep_mode(SLEEP_MODE_IDLE);
+}
+
+#if IUART_COOKED
+static void check_getline(void)
+{
+	char line[16];
+	int c, n = 0;
+
+	sim_reset();
+#if IUART_RS485
+	iuart_set_mode(0, iuart_get_mode(0) & ~IUART_ECHO);	// half duplex, the echo would cost the input
+#endif
+	sim_receive("hellp\bo\r", 8, 0);
+	while ((c = uart_getchar(NULL)) >= 0 && n < (int)sizeof line - 1)
+		if ((line[n++] = c) == '\n')
+			break;
+	line[n] = '\0';
+	CHECK(strcmp(line, "hello\n") == 0, "got \"%s\"", line);
+#if !IUART_RS485
+	sim_drain();
+	CHECK(wire_len >= 7 && memcmp(wire, "hellp", 5) == 0 &&
+		  memcmp(wire + wire_len - 3, "o\r\n", 3) == 0, "echo of %u bytes", wire_len);
+#endif
+}
+#endif
+
+static void check_receive_errors(void)
+{
+	iuart_counters_t k;
+
+	sim_reset();
+	sim_receive("ab", 2, 0);
+	sim_receive("c", 1, _BV(FE0));
+	sim_drain();
+	iuart_get_counters(0, &k);
+	CHECK(k.rx_bytes >= 2 && k.rx_framing == 1, "rx %u framing %u", k.rx_bytes, k.rx_framing);
+	CHECK(iuart_getc(0) == 'a' && iuart_getc(0) == 'b', "data lost");
+}
+
+// Baud rate and frame format changes, and parity errors on the way in
+static void check_config(void)
+{
+	iuart_counters_t k;
+	int16_t error;
+
+	sim_reset();
+	error = iuart_set_baud(0, 115200);
+	CHECK(error > 0 && error < 300 && iuart_get_baud(0) == 115200, "115200 off by %d", error);
+	CHECK((UCSR0A & _BV(U2X0)) && UBRR0H == 0 && UBRR0L == 16, "115200 as UBRR %u, U2X %u",
+		  UBRR0L, (UCSR0A >> U2X0) & 1);
+	CHECK(iuart_set_baud(0, 10) == INT16_MAX && iuart_get_baud(0) == 115200, "10 baud taken");
+	error = iuart_set_baud(0, 2400);
+	CHECK(error == 4 && (UCSR0A & _BV(U2X0)) && ((UBRR0H << 8) | UBRR0L) == 832,
+		  "2400 off by %d", error);
+
+	CHECK(iuart_config(0, IUART_7E1) == 0 && iuart_get_config(0) == IUART_7E1 &&
+		  (UCSR0C & IUART_FORMAT_MASK) == IUART_7E1, "7E1 as UCSR0C 0x%02x", UCSR0C);
+	CHECK(iuart_config(0, IUART_DATA8 | 0x10) == EOF && iuart_get_config(0) == IUART_7E1,
+		  "reserved parity setting taken");
+	iuart_write(0, (const uint8_t *)"\xc1", 1);
+	sim_drain();
+	CHECK(wire_is("\x41", 1), "7 data bits sent as 0x%02x", wire[0]);
+
+	// a byte failing the parity check is counted and dropped
+	sim_receive("a", 1, 0);
+	sim_receive("b", 1, _BV(UPE0));
+	sim_receive("c", 1, 0);
+	sim_drain();
+	iuart_get_counters(0, &k);
+	CHECK(k.rx_parity == 1, "%u parity errors", k.rx_parity);
+	CHECK(iuart_getc(0) == 'a' && iuart_getc(0) == 'c' && iuart_getc(0) == EOF, "parity error kept");
+}
+
+#if IUART_CRC
+static void check_crc(void)
+{
+	iuart_crc_t crc = IUART_CRC_INIT;
+	const char *s = "123456789";
+
+	while (*s)
+		crc = iuart_crc_update(crc, *s++);
+#if IUART_CRC == 16
+	CHECK(crc == 0x4b37, "CRC-16/MODBUS check value %04x", crc);
+#else
+	CHECK(crc == 0xf4, "CRC-8 check value %02x", crc);
+#endif
+
+	sim_reset();
+	iuart_tx_crc_reset(0);
+	iuart_write(0, (const uint8_t *)"123456789", 9);
+	CHECK(iuart_tx_crc(0) == crc, "iuart_write() CRC %04x", iuart_tx_crc(0));
+	sim_drain();
+}
+#endif
+
+#if IUART_FRAMES
+#if IUART_CRC
+#define UART_SIM_CRC_BYTES	IUART_CRC_BYTES
+#else
+#define UART_SIM_CRC_BYTES	0
+#endif
+
+static void check_slip(void)
+{
+	static const uint8_t payload[] = { 0x01, IUART_SLIP_END, 0x02, IUART_SLIP_ESC, 0x03 };
+	uint8_t buf[16];
+	iuart_counters_t k;
+	int16_t n;
+
+	sim_reset();
+	iuart_set_frame_mode(0, IUART_FRAME_SLIP);
+	sim_loopback = 1;
+	CHECK(iuart_frame_send(0, payload, sizeof payload) == 0, "send");
+	sim_drain();
+	CHECK(wire[0] == IUART_SLIP_END && wire[wire_len - 1] == IUART_SLIP_END &&
+		  wire_len == 2 + sizeof payload + 2 + UART_SIM_CRC_BYTES, "encoded in %u bytes", wire_len);
+	n = iuart_frame_read(0, buf, sizeof buf);
+	CHECK(n == sizeof payload && memcmp(buf, payload, n) == 0, "looped back %d bytes", n);
+	CHECK(iuart_frame_len(0) == -1, "extra frame");
+
+#if IUART_CRC
+	// the same frame with its first byte damaged on the way
+	sim_loopback = 0;
+	wire[1] ^= 0x10;
+	sim_receive(wire, wire_len, 0);
+	sim_drain();
+	iuart_get_counters(0, &k);
+	CHECK(iuart_frame_len(0) == -1 && k.rx_crc_errors == 1, "damaged frame taken, %u CRC errors", k.rx_crc_errors);
+#else
+	(void)k;
+#endif
+}
+#endif
+
+#if IUART_RTU
+static void check_rtu(void)
+{
+	static const uint8_t request[] = { 0x11, 0x03, 0x00, 0x6b, 0x00, 0x03 };
+	uint8_t buf[16];
+	int16_t n;
+
+	sim_reset();
+	iuart_set_frame_mode(0, IUART_FRAME_RTU);
+	sim_loopback = 1;
+	CHECK(iuart_frame_send(0, request, sizeof request) == 0, "send");
+	sim_drain();
+	// the Modbus specification's example request, CRC low byte first
+	CHECK(wire_len == sizeof request + 2 && wire[6] == 0x76 && wire[7] == 0x87, "sent %u bytes", wire_len);
+	CHECK(iuart_frame_len(0) == -1, "frame ended before the silence");
+	sim_idle(4 * sim_frame_cycles() + 1750UL * (F_CPU / 1000000UL));
+	n = iuart_frame_read(0, buf, sizeof buf);
+	CHECK(n == sizeof request && memcmp(buf, request, n) == 0, "looped back %d bytes", n);
+}
+#endif
+
+#if IUART_TX_BUFFERS
+static const uint8_t *writev_done;
+
+static void writev_callback(const uint8_t *buf)
+{
+	writev_done = buf;
+}
+
+static void check_writev(void)
+{
+	static const char header[] PROGMEM = "HDR:";
+	static const char body[] = "payload";
+	iuart_iovec_t iov[3] = { { header, 4, 1 }, { body, 7, 0 }, { "!\n", 2, 0 } };
+	static uint8_t fill[UART_BUFFER_SIZE];
+	uint8_t i;
+
+	sim_reset();
+	iuart_set_tx_done(0, writev_callback);
+	writev_done = NULL;
+	iuart_write(0, (const uint8_t *)"<", 1);
+	CHECK(iuart_writev(0, iov, 3) == 0, "writev");
+	iuart_write(0, (const uint8_t *)">", 1);
+	sim_drain();
+	CHECK(wire_is("<HDR:payload!\n>", 15), "got %u bytes", wire_len);	// buffers go out raw
+	CHECK(writev_done == (const uint8_t *)header, "done not called");
+	CHECK(iuart_buffers_pending(0) == 0, "still pending");
+
+	// with every slot taken, flash output is copied in instead of failing
+	sim_reset();
+	iuart_set_tx_policy(0, UART_TX_FAIL);
+	CHECK(iuart_puts_P(0, flash_text) == 0 && iuart_puts_P(0, flash_text) == 0 &&
+		  iuart_puts_P(0, flash_text) == 0 && iuart_puts_P(0, flash_text) == 0 &&
+		  iuart_puts_P(0, flash_text) == 0, "puts_P without a free slot");
+	sim_drain();
+	CHECK(wire_len == 50 && memcmp(wire + 40, flash_text, 10) == 0, "got %u bytes", wire_len);
+
+	// ... and reports what FAIL dropped once the output buffer is full too
+	sim_reset();
+	iuart_set_tx_policy(0, UART_TX_FAIL);
+	for (i = 0; i < IUART_TX_BUFFERS; i++)
+		iuart_puts_P(0, flash_text);
+	memset(fill, '-', sizeof fill);
+	iuart_write(0, fill, sizeof fill);
+	CHECK(iuart_puts_P(0, flash_text) == EOF, "puts_P dropped nothing");
+	sim_drain();
+}
+#endif
+
+#if IUART_XONXOFF
+static void check_xonxoff(void)
+{
+	static uint8_t data[IUART_XOFF_HIGH];
+	uint32_t sent;
+
+	memset(data, 'x', sizeof data);
+	sim_reset();
+	iuart_set_xonxoff(0, 1);
+	sim_receive(data, sizeof data, 0);
+	sim_drain();
+	CHECK(wire_is("\x13", 1), "no XOFF at the high watermark, %u bytes", wire_len);
+	while (iuart_getc(0) != EOF)
+		;
+	sim_drain();
+	CHECK(wire_is("\x13\x11", 2), "no XON once read, %u bytes", wire_len);
+
+	// output stops for an XOFF from the peer, and resumes for its XON
+	sim_receive("\x13", 1, 0);
+	sim_idle(2 * sim_frame_cycles());
+	iuart_write(0, (const uint8_t *)"0123456789", 10);
+	sent = wire_len;
+	sim_idle(20 * sim_frame_cycles());
+	CHECK(wire_len == sent, "sent %u bytes while stopped", wire_len - sent);
+	sim_receive("\x11", 1, 0);
+	sim_drain();
+	CHECK(wire_len == sent + 10 && memcmp(wire + sent, "0123456789", 10) == 0, "resumed with %u bytes", wire_len - sent);
+	iuart_set_xonxoff(0, 0);
+}
+#endif
+
+#if IUART_LINE_MODE
+static void check_line_mode(void)
+{
+	static char expect[164];
+	uint8_t len = 0, i;
+	char *line;
+
+	sim_reset();
+	iuart_set_line_mode(0, 1);
+	sim_receive("abc\r", 4, 0);
+	sim_drain();
+	line = iuart_getline(0, &len);
+	CHECK(line && len == 3 && memcmp(line, "abc\n", 4) == 0, "line of %u", len);
+	iuart_line_release(0);
+	CHECK(wire_len >= 3 && memcmp(wire, "abc", 3) == 0, "echo of %u bytes", wire_len);
+
+	// the RX interrupt leaves the rubouts of a ^u to iuart_getline()
+	sim_reset();
+	iuart_set_line_mode(0, 1);
+	memset(expect, 'a', 40);
+	sim_receive(expect, 40, 0);
+	sim_receive("\x15", 1, 0);
+	sim_drain();
+	CHECK(wire_len == 40, "^u echoed %u bytes from the interrupt", wire_len - 40);
+	CHECK(iuart_getline(0, &len) == 0, "line after ^u");
+	sim_receive("xy\r", 3, 0);
+	sim_drain();
+	line = iuart_getline(0, &len);
+	CHECK(line && len == 2 && memcmp(line, "xy\n", 3) == 0, "line of %u after ^u", len);
+	iuart_line_release(0);
+	sim_drain();
+	for (i = 0; i < 40; i++)
+		memcpy(expect + 40 + 3 * i, "\b \b", 3);
+	memcpy(expect + 160, "xy\r\n", 4);
+	CHECK(wire_is(expect, 164), "^u echo of %u bytes", wire_len);
+	iuart_set_line_mode(0, 0);
+}
+#endif
+
+#if IUART_TX_PRIO
+static void check_prio(void)
+{
+	char *x, *f;
+
+	sim_reset();
+	iuart_write(0, (const uint8_t *)"abcdef", 6);
+	cli();										// as from another ISR
+	CHECK(iuart_try_write(0, (const uint8_t *)"XY", 2) == 0, "try_write");
+	sei();
+	sim_drain();
+	wire[wire_len] = '\0';
+	x = strchr((char *)wire, 'X');
+	f = strchr((char *)wire, 'f');
+	CHECK(wire_len == 8 && x && f && x < f && x[1] == 'Y', "got \"%s\"", wire);
+}
+#endif
+
+#if IUART_LOG
+static void check_log(void)
+{
+	const char *fmt = IUART_LOG_FMT("n=%d %s %lx\n");
+	uint16_t id = (uint16_t)(uintptr_t)fmt;
+	uint8_t expect[16] = { IUART_SLIP_END, id & 0xff, id >> 8, 0x2c, 0x01, 'a', 'b', 0,
+						   0xef, 0xbe, 0xad, 0xde, IUART_SLIP_END };
+	static uint8_t filler[UART_BUFFER_SIZE];
+	iuart_counters_t k;
+	uint32_t failed;
+	uint8_t i, n = 13;
+	size_t sent;
+
+	// an id byte that is END or ESC goes out escaped
+	for (i = 1; i < 3; i++)
+		if (expect[i] == IUART_SLIP_END || expect[i] == IUART_SLIP_ESC) {
+			memmove(expect + i + 2, expect + i + 1, n - i - 1);
+			expect[i + 1] = expect[i] == IUART_SLIP_END ? IUART_SLIP_ESC_END : IUART_SLIP_ESC_ESC;
+			expect[i] = IUART_SLIP_ESC;
+			n++;
+			i++;
+		}
+	sim_reset();
+	iuart_log(0, fmt, 300, "ab", 0xdeadbeefUL);
+	sim_drain();
+	CHECK(wire_is(expect, n), "record of %u bytes", wire_len);
+
+	// with UART_TX_FAIL a record that doesn't fit is left out whole
+	sim_reset();
+	iuart_set_tx_policy(0, UART_TX_FAIL);
+	memset(filler, 'f', sizeof filler);
+	sent = iuart_write(0, filler, sizeof filler);
+	iuart_get_counters(0, &k);
+	failed = k.tx_failed;
+	iuart_log(0, fmt, 300, "ab", 0xdeadbeefUL);
+	iuart_get_counters(0, &k);
+	sim_drain();
+	CHECK(wire_is(filler, sent) && k.tx_failed - failed == n, "sent %u of %zu, %u failed",
+		  wire_len, sent, k.tx_failed - failed);
+}
+#endif
+
+#if IUART_AUTOBAUD
+static void check_autobaud(void)
+{
+	static const uint32_t rates[] = { 2400, 9600, 57600, 115200, 250000 };
+	uint64_t start;
+	uint32_t baud;
+	uint8_t i;
+
+	for (i = 0; i < sizeof rates / sizeof rates[0]; i++) {
+		sim_reset();
+		TCCR1B = _BV(CS11);
+		sim_line_send("\xf0\x00UUU", 5, rates[i]);	// a 'U' caught halfway first
+		baud = iuart_autobaud(0, 100);
+		CHECK(baud == rates[i] && iuart_get_baud(0) == rates[i],
+			  "autobaud at %u found %u", rates[i], baud);
+		CHECK(TCCR1B == _BV(CS11) && !TIMSK1 && (UCSR0B & _BV(RXEN0)),
+			  "autobaud at %u left Timer1 or the receiver changed", rates[i]);
+	}
+
+	sim_reset();
+	sim_line_send("\x5a", 1, 9600);
+	start = sim_now;
+	baud = iuart_autobaud(0, 20);
+	CHECK(baud == 0 && iuart_get_baud(0) == USART_BAUDRATE, "autobaud took a 0x5a as %u", baud);
+	CHECK(sim_now - start >= 20 * (F_CPU / 1000) && sim_now - start < 30 * (F_CPU / 1000),
+		  "autobaud gave up after %u cycles", (uint32_t)(sim_now - start));
+
+	iuart_host_sreg = 0;
+	CHECK(iuart_autobaud(0, 20) == 0, "autobaud waited with interrupts disabled");
+	iuart_host_sreg = _BV(SREG_I);
+	TCCR1B = 0;
+}
+#endif
+
+#if IUART_MULTIDROP
+static void check_multidrop(void)
+{
+	static const uint8_t bus[] = { 'a', 0x34, 'b', 0x12, 'c', 'd', 0x34, 'e' };
+	static const uint8_t address[] = { 0, SIM_BIT9, 0, SIM_BIT9, 0, 0, SIM_BIT9, 0 };
+	uint8_t i;
+
+	// a node only takes the data that follows its own address
+	sim_reset();
+	iuart_set_multidrop(0, IUART_MULTIDROP_NODE, 0x12);
+	CHECK(iuart_config(0, IUART_7E1) == EOF, "7 data bits taken in 9-bit mode");
+	for (i = 0; i < sizeof bus; i++)
+		sim_receive(&bus[i], 1, address[i]);
+	sim_drain();
+	CHECK(iuart_getc(0) == 'c' && iuart_getc(0) == 'd' && iuart_getc(0) == EOF, "node received wrong data");
+	CHECK(UCSR0A & _BV(MPCM0), "node not filtering after another address");
+
+	// the master sends the address frame ahead of the data
+	sim_reset();
+	iuart_set_multidrop(0, IUART_MULTIDROP_MASTER, 0);
+	iuart_write(0, (const uint8_t *)"<", 1);
+	CHECK(iuart_send_address(0, 0x12) == 0, "send_address");
+	iuart_write(0, (const uint8_t *)"hi", 2);
+	sim_drain();
+	CHECK(wire_is("<\x12hi", 4) && !wire9[0] && wire9[1] && !wire9[2] && !wire9[3],
+		  "got %u bytes, 9th bits %u%u%u%u", wire_len, wire9[0], wire9[1], wire9[2], wire9[3]);
+}
+#endif
+
+#if IUART_FLOW_CONTROL
+#define RTS_IS_OFF()		(IUART_RTS_PORT & _BV(IUART_RTS_BIT) ? 1 : 0)
+
+static void check_flow_control(void)
+{
+	static uint8_t data[32];
+	iuart_counters_t k;
+	uint8_t i;
+
+	// output pauses while CTS is off, and resumes from its pin change
+	sim_reset();
+	memset(data, 'x', sizeof data);
+	sim_cts(1);
+	iuart_write(0, data, sizeof data);
+	sim_idle(4 * sim_frame_cycles());
+	CHECK(wire_len <= 2, "%u bytes sent with CTS off", wire_len);
+	sim_cts(0);
+	sim_drain();
+	iuart_get_counters(0, &k);
+	CHECK(wire_is(data, sizeof data) && k.tx_paused == 1, "got %u bytes, paused %u times",
+		  wire_len, k.tx_paused);
+
+	// RTS goes off as the receive buffer fills, and on again once read
+	CHECK(!RTS_IS_OFF(), "RTS off after init");
+	sim_receive(data, IUART_RTS_HIGH, 0);
+	sim_drain();
+	CHECK(RTS_IS_OFF(), "RTS still on with %u bytes received", IUART_RTS_HIGH);
+	for (i = 0; i < IUART_RTS_HIGH - IUART_RTS_LOW - 1; i++)
+		iuart_getc(0);
+	CHECK(RTS_IS_OFF(), "RTS on above the low mark");
+	iuart_getc(0);
+	CHECK(!RTS_IS_OFF(), "RTS still off down at the low mark");
+}
+#endif
+
+#if IUART_INSTRUMENT
+static void check_instrument(void)
+{
+	iuart_stats_t st;
+
+	sim_reset();
+	iuart_write(0, (const uint8_t *)"abc", 3);
+	sim_receive("xy", 2, 0);
+	sim_drain();
+	iuart_stats(0, &st);
+	CHECK(st.rx.count == 2 && st.udre.count >= 3 && st.tx.count >= 1, "counted rx %u udre %u tx %u",
+		  st.rx.count, st.udre.count, st.tx.count);
+	CHECK(st.rx.min <= st.rx.avg && st.rx.avg <= st.rx.max && st.udre.min <= st.udre.max,
+		  "rx min %u avg %u max %u", st.rx.min, st.rx.avg, st.rx.max);
+	iuart_stats_reset(0);
+	iuart_stats(0, &st);
+	CHECK(st.rx.count == 0 && st.udre.count == 0 && st.tx.count == 0, "not reset");
+}
+#endif
+
+#if IUART_RS485
+#define DE_IS_ON()			(IUART_DE_PORT & _BV(IUART_DE_BIT) ? 1 : 0)
+
+static void check_rs485(void)
+{
+	sim_reset();
+	CHECK(!DE_IS_ON(), "driver enabled while idle");
+	iuart_write(0, (const uint8_t *)"ping", 4);
+	CHECK(DE_IS_ON(), "driver not enabled for sending");
+	sim_idle(2 * sim_frame_cycles());
+	CHECK(DE_IS_ON(), "driver released while sending");
+	sim_drain();
+	CHECK(wire_is("ping", 4) && !DE_IS_ON(), "driver still enabled after %u bytes", wire_len);
+}
+#endif
+
+static int run_checks(void)
+{
+	check_printf();
+	check_stdio();
+	check_policies();
+#if IUART_COOKED
+	check_getline();
+#endif
+	check_receive_errors();
+	check_config();
+#if IUART_CRC
+	check_crc();
+#endif
+#if IUART_FRAMES
+	check_slip();
+#endif
+#if IUART_RTU
+	check_rtu();
+#endif
+#if IUART_TX_BUFFERS
+	check_writev();
+#endif
+#if IUART_XONXOFF
+	check_xonxoff();
+#endif
+#if IUART_LINE_MODE
+	check_line_mode();
+#endif
+#if IUART_TX_PRIO
+	check_prio();
+#endif
+#if IUART_LOG
+	check_log();
+#endif
+#if IUART_RS485
+	check_rs485();
+#endif
+#if IUART_AUTOBAUD
+	check_autobaud();
+#endif
+#if IUART_MULTIDROP
+	check_multidrop();
+#endif
+#if IUART_FLOW_CONTROL
+	check_flow_control();
+#endif
+#if IUART_INSTRUMENT
+	check_instrument();
+#endif
+	printf("%s: %d failed\n", failures ? "FAIL" : "ok", failures);
+	return failures != 0;
+}
+
+//********************************
+//       BENCHMARK
+//********************************
+
+static uint8_t traffic[SIM_QUEUE_SIZE];
+static uint32_t traffic_len;
+static uint32_t bench_baud;
+
+// Made up traffic for runs without a capture: lines of log text
+static void make_traffic(void)
+{
+	uint32_t n = 0;
+
+	while (traffic_len < 8192) {
+		traffic_len += snprintf((char *)traffic + traffic_len, sizeof traffic - traffic_len,
+								"%06u t=%u.%03u adc=%4u,%4u state=%s\n", n, n / 100, n % 100 * 10,
+								(n * 37) % 1024, (n * 91) % 1024, n % 3 ? "run" : "idle");
+		n++;
+	}
+}
+
+static int load_traffic(const char *name)
+{
+	FILE *f = fopen(name, "rb");
+
+	if (!f) {
+		perror(name);
+		return -1;
+	}
+	traffic_len = fread(traffic, 1, sizeof traffic, f);
+	fclose(f);
+	return 0;
+}
+
+#define BENCH_RUNS			5			// runs of each rate, see host_windows_t
+
+// Sends and then receives the traffic once. Returns the number of bytes that
+// didn't come through as they should, and adds those the hardware or the
+// driver dropped to *lost.
+static uint32_t bench_run(FILE *stream, uint64_t *tx_time, uint64_t *rx_time, uint64_t *driver, uint32_t *lost)
+{
+	iuart_counters_t k;
+	uint64_t t, start;
+	uint32_t i, bad = 0;
+
+	sim_reset();
+	iuart_set_baud(0, bench_baud);
+	iuart_set_tx_policy(0, UART_TX_BLOCK);
+#if IUART_COOKED
+	iuart_set_mode(0, 0);
+#endif
+
+	// output, as fast as the line takes it
+	t = host_clock();
+	start = sim_now;
+	for (i = 0; i < traffic_len; i++)
+		UART0_Putchar(traffic[i], stream);
+	iuart_flush(0);
+	*tx_time = sim_now - start;
+	sim_drain();
+	if (!wire_is(traffic, traffic_len))
+		bad++;
+
+	// input, at the line rate
+	sim_receive(traffic, traffic_len, 0);
+	start = sim_now;
+	for (i = 0; i < traffic_len; i++)
+		if (uart_getchar(stream) != traffic[i])
+			bad++;
+	*rx_time = sim_now - start;
+	*driver = host_clock() - t - host_harness;
+
+	iuart_get_counters(0, &k);
+	*lost += sim_overruns + k.rx_overruns + k.rx_dropped;
+	return bad;
+}
+
+static void bench(void)
+{
+	FILE *stream = fopen("/dev/null", "w");
+	uint64_t tx_time, rx_time, driver, best = UINT64_MAX;
+	uint32_t irq_off, isr, bad = 0, lost = 0;
+	uint8_t i;
+
+	for (i = 0; i < BENCH_RUNS; i++) {
+		host_first_run = i == 0;
+		bad += bench_run(stream, &tx_time, &rx_time, &driver, &lost);
+		if (driver < best)
+			best = driver;
+	}
+	host_first_run = 1;
+	irq_off = host_window_max(&host_irq_off_windows);
+	isr = host_window_max(&host_isr_windows);
+
+	printf("%8lu  %8.0f %8.0f %8.0f %9.1f %8lu %8lu %8lu %6lu %s\n", (unsigned long)bench_baud,
+		   (double)F_CPU / sim_frame_cycles(),
+		   traffic_len * (double)F_CPU / tx_time, traffic_len * (double)F_CPU / rx_time,
+		   (double)best / (2 * traffic_len), (unsigned long)irq_off, (unsigned long)isr,
+		   (unsigned long)irq_off + isr, (unsigned long)lost, bad ? "MISMATCH" : "");
+	fclose(stream);
+}
+
+static int run_bench(const char *capture)
+{
+	static const uint32_t rates[] = { 9600, 57600, 115200, 250000, 500000, 1000000 };
+	uint8_t i;
+
+	if (capture) {
+		if (load_traffic(capture) < 0)
+			return 2;
+	} else
+		make_traffic();
+
+	printf("%u bytes each way, F_CPU %lu, host times in %s\n", traffic_len, (unsigned long)F_CPU, HOST_UNIT);
+	printf("    baud    line/s     tx/s     rx/s  per byte  irq off  max isr  latency  lost\n");
+	for (i = 0; i < sizeof rates / sizeof rates[0]; i++) {
+		bench_baud = rates[i];
+		bench();
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "-b") == 0)
+		return run_bench(argc > 2 ? argv[2] : NULL);
+	if (argc > 1) {
+		fprintf(stderr, "usage: %s [-b [capture]]\n", argv[0]);
+		return 2;
+	}
+	return run_checks();
+}
@@ -6,107 +6,2623 @@
 
 /*	This code implements an interrupt driven UART (both TX and RX)
 	on the ATmega Serial port. */
-	
+
 #include <ctype.h>
+#include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
-	
+
+#include "iuart_hw.h"
 #include "iuart.h"
 
-char ReceivedByte;
+#if (IUART_USE_USART1 && !defined (UDR1)) || (IUART_USE_USART2 && !defined (UDR2)) || (IUART_USE_USART3 && !defined (UDR3))
+#error "an enabled USART does not exist on this device"
+#endif
 
-void init_iuart(void)
+#if IUART_XONXOFF && (IUART_XON_LOW >= IUART_XOFF_HIGH || \
+					  IUART_XOFF_HIGH >= UART_RX_BUFFER_SIZE)
+#error "IUART_XON_LOW must be below IUART_XOFF_HIGH, and that below UART_RX_BUFFER_SIZE"
+#endif
+
+#if IUART_RS485
+#if !(IUART_RS485_PORT == 0 ? IUART_USE_USART0 : IUART_RS485_PORT == 1 ? IUART_USE_USART1 : \
+	  IUART_RS485_PORT == 2 ? IUART_USE_USART2 : IUART_RS485_PORT == 3 ? IUART_USE_USART3 : 0)
+#error "IUART_RS485_PORT is not an enabled port"
+#endif
+#if !defined (IUART_DE_PORT) || !defined (IUART_DE_DDR) || !defined (IUART_DE_BIT)
+#error "IUART_RS485 needs the driver enable pin defined, see iuart.h"
+#endif
+#endif
+
+#if IUART_FLOW_CONTROL
+#if !(IUART_FLOW_PORT == 0 ? IUART_USE_USART0 : IUART_FLOW_PORT == 1 ? IUART_USE_USART1 : \
+	  IUART_FLOW_PORT == 2 ? IUART_USE_USART2 : IUART_FLOW_PORT == 3 ? IUART_USE_USART3 : 0)
+#error "IUART_FLOW_PORT is not an enabled port"
+#endif
+#if !defined (IUART_RTS_PORT) || !defined (IUART_RTS_DDR) || !defined (IUART_RTS_BIT) || \
+	!defined (IUART_CTS_PIN) || !defined (IUART_CTS_BIT) || !defined (IUART_CTS_PCMSK) || \
+	!defined (IUART_CTS_PCINT) || !defined (IUART_CTS_PCIE) || !defined (IUART_CTS_vect)
+#error "IUART_FLOW_CONTROL needs the RTS and CTS pins defined, see iuart.h"
+#endif
+#if IUART_RTS_LOW >= IUART_RTS_HIGH || IUART_RTS_HIGH >= UART_RX_BUFFER_SIZE
+#error "IUART_RTS_LOW must be below IUART_RTS_HIGH, and that below UART_RX_BUFFER_SIZE"
+#endif
+#endif
+
+#if IUART_RTU && !(IUART_RTU_PORT == 0 ? IUART_USE_USART0 : IUART_RTU_PORT == 1 ? IUART_USE_USART1 : \
+	  IUART_RTU_PORT == 2 ? IUART_USE_USART2 : IUART_RTU_PORT == 3 ? IUART_USE_USART3 : 0)
+#error "IUART_RTU_PORT is not an enabled port"
+#endif
+
+#if IUART_AUTOBAUD
+#if !(IUART_AUTOBAUD_PORT == 0 ? IUART_USE_USART0 : IUART_AUTOBAUD_PORT == 1 ? IUART_USE_USART1 : \
+	  IUART_AUTOBAUD_PORT == 2 ? IUART_USE_USART2 : IUART_AUTOBAUD_PORT == 3 ? IUART_USE_USART3 : 0)
+#error "IUART_AUTOBAUD_PORT is not an enabled port"
+#endif
+#endif
+
+// Keeps the compiler from moving buffer accesses across an index update, so a
+// byte is always stored before the index that hands it over is published, and
+// only read after the index saying it is there.
+#define IUART_BARRIER()		__asm__ __volatile__ ("" ::: "memory")
+
+// Above 256 bytes a buffer's indices are 16 bits, which the AVR loads and
+// stores a byte at a time. Outside the ISRs, an index they move is then read,
+// and an index they read is then written, with interrupts disabled, so no
+// interrupt ever sees half an update and no reader half of one. Up to 256
+// bytes these are single byte accesses and need nothing.
+#if UART_BUFFER_SIZE > 256
+#define UART_TX_INDEX_ATOMIC()		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#else
+#define UART_TX_INDEX_ATOMIC()
+#endif
+#if UART_RX_BUFFER_SIZE > 256
+#define UART_RX_INDEX_ATOMIC()		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#else
+#define UART_RX_INDEX_ATOMIC()
+#endif
+
+// Puts the CPU in idle sleep, where the USARTs keep running, until cond holds.
+// cond is tested with interrupts disabled and sei only takes effect after the
+// next instruction, which is the sleep itself, so an interrupt that makes cond
+// true either runs before the test or wakes us from that very sleep; it can't
+// slip in between and leave us asleep. The application's sleep mode is put
+// back afterwards. Only call with interrupts enabled.
+#define UART_SLEEP_MODE_MASK		(_BV(SM0) | _BV(SM1) | _BV(SM2))
+#define IUART_SLEEP_UNTIL(cond)				\
+	do {									\
+		uint8_t sleep_mode_saved = SMCR & UART_SLEEP_MODE_MASK;	\
+		set_sleep_mode(SLEEP_MODE_IDLE);	\
+		for (;;) {							\
+			cli();							\
+			if (cond)						\
+				break;						\
+			sleep_enable();					\
+			sei();							\
+			sleep_cpu();					\
+			sleep_disable();				\
+		}									\
+		set_sleep_mode(sleep_mode_saved);	\
+		sei();								\
+	} while (0)
+
+// Every USART has the same register block layout, starting at UCSRnA, and the
+// same bit positions in it, so the USART0 bit names are used for all of them.
+typedef struct
+{
+	volatile uint8_t ucsra;
+	volatile uint8_t ucsrb;
+	volatile uint8_t ucsrc;
+	volatile uint8_t reserved;
+	volatile uint8_t ubrrl;
+	volatile uint8_t ubrrh;
+	volatile uint8_t udr;
+} iuart_regs_t;
+
+#define IUART_REGS(n)		((iuart_regs_t *)&UCSR##n##A)
+
+// All the state of one UART port. The indices shared with the interrupt
+// handlers are volatile and come first, next to each other; the buffers
+// themselves are only touched between index updates, under IUART_BARRIER().
+typedef struct
+{
+	volatile uart_tx_index_t tx_next_to_send;	// position of next byte to be sent
+	volatile uart_tx_index_t tx_next_free;		// position of next free byte of buffer
+	volatile uint8_t sending_in_progress;		// 1 = bytes are still on their way out of the UART
+	uint8_t tx_policy;							// one of UART_TX_BLOCK, UART_TX_FAIL, UART_TX_DROP_OLDEST
+#if IUART_TX_PRIO
+	volatile uint8_t prio_next_to_send;			// indices of the ring filled from interrupt context,
+	volatile uint8_t prio_next_free;			// each written by one side only
+#endif
+#if IUART_TX_BUFFERS
+	volatile uint8_t seg_next_to_send;			// free-running indices of the handed over buffers
+	volatile uint8_t seg_next_free;
+	const uint8_t *seg_ptr;						// next byte of the segment being sent
+	uint16_t seg_left;							// bytes of it still to send, 0 = none being sent
+	uint8_t seg_iov;							// which segment of the buffer that is
+	uint8_t seg_flash;							// 1 = it is read from program memory
+#if IUART_COOKED
+	uint8_t seg_onlcr;							// 1 = newlines in the buffer get a carriage return
+	uint8_t seg_cr;								// 1 = the carriage return for the next byte was sent
+#endif
+	iuart_tx_done_t seg_done;					// called as each buffer is done
+	struct
+	{
+		iuart_iovec_t iov[IUART_TX_IOV];		// its segments, none of them empty
+		uint8_t iovcnt;
+#if IUART_COOKED
+		uint8_t onlcr;							// 1 = send a carriage return before each newline
+#endif
+		uart_tx_index_t at;						// output buffer position the buffer goes out at
+	} seg[IUART_TX_BUFFERS];
+#endif
+
+	volatile uart_rx_index_t rx_next_to_read;	// position of next byte to be read
+	volatile uart_rx_index_t rx_next_free;		// position of next free byte of buffer
+	volatile uint8_t rx_status;					// FE0/DOR0/UPE0 error flags latched by the RX interrupt
+#if IUART_MULTIDROP
+	uint8_t multidrop;							// one of IUART_MULTIDROP_OFF, _MASTER, _NODE
+	uint8_t address;							// node address on the bus
+#endif
+#if IUART_XONXOFF
+	uint8_t xonxoff;							// 1 = XON/XOFF flow control
+	uint8_t rx_stopped;							// 1 = we sent the peer an XOFF
+	volatile uint8_t tx_stopped;				// 1 = the peer sent us an XOFF
+	volatile uint8_t tx_control;				// XON or XOFF to send ahead of the buffer, 0 for none
+#endif
+#if IUART_XONXOFF || IUART_TX_PRIO
+	volatile uint8_t tx_locked;					// 1 = between uart_tx_lock() and uart_tx_unlock()
+#endif
+
+	uint32_t baud;								// baud rate last selected with iuart_set_baud()
+#if IUART_CRC
+	iuart_crc_t tx_crc;							// running CRC of the bytes queued by iuart_write()
+#endif
+#if IUART_COOKED
+	uint8_t mode;								// IUART_ONLCR, IUART_ICRNL, IUART_ECHO, IUART_ICANON
+#endif
+
+	iuart_counters_t counters;
+#if IUART_INSTRUMENT
+	iuart_stats_t stats;
+	uint16_t lock_start;						// timestamp of the last uart_tx_lock()
+#endif
+
+	char *line_next;							// next character of the line handed out by uart_getchar()
+	uint8_t line_len;							// characters in the line being edited
+	uint8_t line_done_len;						// characters in the completed line, without its \n
+	uint8_t line_shown;							// characters of the line the terminal shows
+	uint8_t line_keep;							// how many of those still match the line
+	uint8_t line_echo;							// UART_LINE_REPRINT, _NEWLINE: echo still owed
+#if IUART_LINE_MODE
+	uint8_t line_mode;							// 1 = lines are assembled by the RX interrupt
+#endif
+	volatile uint8_t line_ready;				// 1 = line holds a completed line, up to its \n
+	char line[RX_BUFSIZE + 1];					// line being edited or handed out, room for a final \0
+
+#if IUART_FRAMES
+	uint8_t frame_mode;							// IUART_FRAME_OFF, _SLIP or _RTU
+	uint8_t frame_esc;							// 1 = the last byte received was IUART_SLIP_ESC
+	uint8_t frame_bad;							// 1 = the frame being received is damaged, skip to its end
+	uart_rx_index_t frame_head;					// where the next decoded byte goes, past rx_next_free
+	volatile uint8_t frame_next_to_read;		// free-running indices of the completed frame queue
+	volatile uint8_t frame_next_free;
+	uart_rx_index_t frame_len[IUART_FRAME_QUEUE];	// lengths of the completed frames, oldest first
+#if IUART_CRC
+	iuart_crc_t frame_crc;						// CRC of the frame being received, so far
+#endif
+#if IUART_RTU
+	uint16_t rtu_gap;							// Timer1 ticks of silence that end a frame
+#endif
+#endif
+
+	char tx_buffer[UART_BUFFER_SIZE];			// this is a wrap-around buffer
+#if IUART_TX_PRIO
+	char prio_buffer[IUART_TX_PRIO];			// output queued by iuart_try_putc(), sent first
+#endif
+	char rx_buffer[UART_RX_BUFFER_SIZE];		// wrap-around buffer filled by the RX interrupt
+} iuart_port_t;
+
+#if IUART_USE_USART0
+static iuart_port_t iuart_port0;
+#endif
+#if IUART_USE_USART1
+static iuart_port_t iuart_port1;
+#endif
+#if IUART_USE_USART2
+static iuart_port_t iuart_port2;
+#endif
+#if IUART_USE_USART3
+static iuart_port_t iuart_port3;
+#endif
+
+// Maps a port number to its state and registers. With a constant port number,
+// or with a single port enabled, this folds into a fixed address, so the
+// single-port build addresses everything directly, as it always did.
+static inline iuart_port_t *iuart_state(uint8_t port)
+{
+	switch (port)
+	{
+#if IUART_USE_USART1
+	case 1: return &iuart_port1;
+#endif
+#if IUART_USE_USART2
+	case 2: return &iuart_port2;
+#endif
+#if IUART_USE_USART3
+	case 3: return &iuart_port3;
+#endif
+	default:
+#if IUART_USE_USART0
+		return &iuart_port0;
+#elif IUART_USE_USART1
+		return &iuart_port1;
+#elif IUART_USE_USART2
+		return &iuart_port2;
+#else
+		return &iuart_port3;
+#endif
+	}
+}
+
+static inline iuart_regs_t *iuart_regs(uint8_t port)
 {
+	switch (port)
+	{
+#if IUART_USE_USART1
+	case 1: return IUART_REGS(1);
+#endif
+#if IUART_USE_USART2
+	case 2: return IUART_REGS(2);
+#endif
+#if IUART_USE_USART3
+	case 3: return IUART_REGS(3);
+#endif
+	default:
+#if IUART_USE_USART0
+		return IUART_REGS(0);
+#elif IUART_USE_USART1
+		return IUART_REGS(1);
+#elif IUART_USE_USART2
+		return IUART_REGS(2);
+#else
+		return IUART_REGS(3);
+#endif
+	}
+}
+
+#if IUART_INSTRUMENT
+// Timestamps come from the free-running Timer1. Reading TCNT1 goes through the
+// shared TEMP register, so interrupts are kept off for the two byte reads.
+static inline uint16_t uart_timestamp(void)
+{
+	uint16_t t;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		t = TCNT1;
+	}
+	return t;
+}
+
+// Adds one measurement to an ISR's statistics. The average stops being
+// updated once the count saturates; min and max keep going.
+static inline void uart_stat_add(iuart_isr_stat_t *stat, uint16_t ticks)
+{
+	if (ticks < stat->min || stat->count == 0)
+		stat->min = ticks;
+	if (ticks > stat->max)
+		stat->max = ticks;
+	if (stat->count != UINT16_MAX)
+	{
+		stat->count++;
+		stat->total += ticks;
+	}
+}
+
+#if defined (IUART_PROBE_PORT)
+#define IUART_PROBE_ON()	(IUART_PROBE_PORT |= _BV(IUART_PROBE_BIT))
+#define IUART_PROBE_OFF()	(IUART_PROBE_PORT &= ~_BV(IUART_PROBE_BIT))
+#else
+#define IUART_PROBE_ON()
+#define IUART_PROBE_OFF()
+#endif
+
+#define IUART_ISR_ENTER()	uint16_t isr_start = TCNT1; IUART_PROBE_ON()
+#define IUART_ISR_EXIT(p, which)	\
+	do { IUART_PROBE_OFF(); uart_stat_add(&(p)->stats.which, TCNT1 - isr_start); } while (0)
+#else
+#define IUART_ISR_ENTER()
+#define IUART_ISR_EXIT(p, which)
+#endif
+
+// Whether the port has anything left to send from interrupt context, with
+// IUART_TX_PRIO.
+#if IUART_TX_PRIO
+#define UART_PRIO_MASK				(IUART_TX_PRIO - 1)
+#define UART_PRIO_PENDING(p)		((p)->prio_next_to_send != (p)->prio_next_free)
+#else
+#define UART_PRIO_PENDING(p)		0
+#endif
+
+// With IUART_TX_PRIO other interrupts, and with XON/XOFF or line mode the RX
+// interrupt, may change UCSRnB at any time, so every read-modify-write of it
+// outside the port's own interrupts goes in a UART_UCSRB_ATOMIC() block,
+// which would otherwise write back a stale copy.
+#if IUART_TX_PRIO || IUART_XONXOFF || IUART_LINE_MODE
+#define UART_UCSRB_ATOMIC()			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#else
+#define UART_UCSRB_ATOMIC()
+#endif
+
+// Whether the port has anything left to send, in the output buffer, from
+// interrupt context or, with IUART_TX_BUFFERS, in handed over buffers.
+#if IUART_TX_BUFFERS
+#define UART_TX_PENDING(p)			((p)->tx_next_to_send != (p)->tx_next_free ||	\
+									 (p)->seg_next_to_send != (p)->seg_next_free ||	\
+									 UART_PRIO_PENDING(p))
+#else
+#define UART_TX_PENDING(p)			((p)->tx_next_to_send != (p)->tx_next_free ||	\
+									 UART_PRIO_PENDING(p))
+#endif
+
+// Tests one of a port's IUART_MODE flags. In a raw build they are all
+// constant 0, so the translations and the echo compile away.
+#if IUART_COOKED
+#define UART_MODE(p, flag)			((p)->mode & (flag))
+#else
+#define UART_MODE(p, flag)			0
+#endif
+
+#if IUART_CRC
+#if IUART_CRC_TABLE
+// CRC of every byte value, so an update is one lookup
+#if IUART_CRC == 16
+static const uint16_t uart_crc_table[256] PROGMEM =
+{
+	0x0000, 0xc0c1, 0xc181, 0x0140, 0xc301, 0x03c0, 0x0280, 0xc241,
+	0xc601, 0x06c0, 0x0780, 0xc741, 0x0500, 0xc5c1, 0xc481, 0x0440,
+	0xcc01, 0x0cc0, 0x0d80, 0xcd41, 0x0f00, 0xcfc1, 0xce81, 0x0e40,
+	0x0a00, 0xcac1, 0xcb81, 0x0b40, 0xc901, 0x09c0, 0x0880, 0xc841,
+	0xd801, 0x18c0, 0x1980, 0xd941, 0x1b00, 0xdbc1, 0xda81, 0x1a40,
+	0x1e00, 0xdec1, 0xdf81, 0x1f40, 0xdd01, 0x1dc0, 0x1c80, 0xdc41,
+	0x1400, 0xd4c1, 0xd581, 0x1540, 0xd701, 0x17c0, 0x1680, 0xd641,
+	0xd201, 0x12c0, 0x1380, 0xd341, 0x1100, 0xd1c1, 0xd081, 0x1040,
+	0xf001, 0x30c0, 0x3180, 0xf141, 0x3300, 0xf3c1, 0xf281, 0x3240,
+	0x3600, 0xf6c1, 0xf781, 0x3740, 0xf501, 0x35c0, 0x3480, 0xf441,
+	0x3c00, 0xfcc1, 0xfd81, 0x3d40, 0xff01, 0x3fc0, 0x3e80, 0xfe41,
+	0xfa01, 0x3ac0, 0x3b80, 0xfb41, 0x3900, 0xf9c1, 0xf881, 0x3840,
+	0x2800, 0xe8c1, 0xe981, 0x2940, 0xeb01, 0x2bc0, 0x2a80, 0xea41,
+	0xee01, 0x2ec0, 0x2f80, 0xef41, 0x2d00, 0xedc1, 0xec81, 0x2c40,
+	0xe401, 0x24c0, 0x2580, 0xe541, 0x2700, 0xe7c1, 0xe681, 0x2640,
+	0x2200, 0xe2c1, 0xe381, 0x2340, 0xe101, 0x21c0, 0x2080, 0xe041,
+	0xa001, 0x60c0, 0x6180, 0xa141, 0x6300, 0xa3c1, 0xa281, 0x6240,
+	0x6600, 0xa6c1, 0xa781, 0x6740, 0xa501, 0x65c0, 0x6480, 0xa441,
+	0x6c00, 0xacc1, 0xad81, 0x6d40, 0xaf01, 0x6fc0, 0x6e80, 0xae41,
+	0xaa01, 0x6ac0, 0x6b80, 0xab41, 0x6900, 0xa9c1, 0xa881, 0x6840,
+	0x7800, 0xb8c1, 0xb981, 0x7940, 0xbb01, 0x7bc0, 0x7a80, 0xba41,
+	0xbe01, 0x7ec0, 0x7f80, 0xbf41, 0x7d00, 0xbdc1, 0xbc81, 0x7c40,
+	0xb401, 0x74c0, 0x7580, 0xb541, 0x7700, 0xb7c1, 0xb681, 0x7640,
+	0x7200, 0xb2c1, 0xb381, 0x7340, 0xb101, 0x71c0, 0x7080, 0xb041,
+	0x5000, 0x90c1, 0x9181, 0x5140, 0x9301, 0x53c0, 0x5280, 0x9241,
+	0x9601, 0x56c0, 0x5780, 0x9741, 0x5500, 0x95c1, 0x9481, 0x5440,
+	0x9c01, 0x5cc0, 0x5d80, 0x9d41, 0x5f00, 0x9fc1, 0x9e81, 0x5e40,
+	0x5a00, 0x9ac1, 0x9b81, 0x5b40, 0x9901, 0x59c0, 0x5880, 0x9841,
+	0x8801, 0x48c0, 0x4980, 0x8941, 0x4b00, 0x8bc1, 0x8a81, 0x4a40,
+	0x4e00, 0x8ec1, 0x8f81, 0x4f40, 0x8d01, 0x4dc0, 0x4c80, 0x8c41,
+	0x4400, 0x84c1, 0x8581, 0x4540, 0x8701, 0x47c0, 0x4680, 0x8641,
+	0x8201, 0x42c0, 0x4380, 0x8341, 0x4100, 0x81c1, 0x8081, 0x4040
+};
+
+static inline uint16_t uart_crc_update(uint16_t crc, uint8_t c)
+{
+	return (crc >> 8) ^ pgm_read_word(&uart_crc_table[(uint8_t)crc ^ c]);
+}
+#else
+static const uint8_t uart_crc_table[256] PROGMEM =
+{
+	0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31,
+	0x24, 0x23, 0x2a, 0x2d, 0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65,
+	0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d, 0xe0, 0xe7, 0xee, 0xe9,
+	0xfc, 0xfb, 0xf2, 0xf5, 0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+	0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85, 0xa8, 0xaf, 0xa6, 0xa1,
+	0xb4, 0xb3, 0xba, 0xbd, 0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2,
+	0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea, 0xb7, 0xb0, 0xb9, 0xbe,
+	0xab, 0xac, 0xa5, 0xa2, 0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+	0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32, 0x1f, 0x18, 0x11, 0x16,
+	0x03, 0x04, 0x0d, 0x0a, 0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42,
+	0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a, 0x89, 0x8e, 0x87, 0x80,
+	0x95, 0x92, 0x9b, 0x9c, 0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+	0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec, 0xc1, 0xc6, 0xcf, 0xc8,
+	0xdd, 0xda, 0xd3, 0xd4, 0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c,
+	0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44, 0x19, 0x1e, 0x17, 0x10,
+	0x05, 0x02, 0x0b, 0x0c, 0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+	0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b, 0x76, 0x71, 0x78, 0x7f,
+	0x6a, 0x6d, 0x64, 0x63, 0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b,
+	0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13, 0xae, 0xa9, 0xa0, 0xa7,
+	0xb2, 0xb5, 0xbc, 0xbb, 0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+	0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb, 0xe6, 0xe1, 0xe8, 0xef,
+	0xfa, 0xfd, 0xf4, 0xf3
+};
+
+static inline uint8_t uart_crc_update(uint8_t crc, uint8_t c)
+{
+	return pgm_read_byte(&uart_crc_table[crc ^ c]);
+}
+#endif
+#elif IUART_CRC == 16
+#define uart_crc_update(crc, c)		_crc16_update(crc, c)
+#else
+#define uart_crc_update(crc, c)		_crc8_ccitt_update(crc, c)
+#endif
+
+iuart_crc_t iuart_crc_update(iuart_crc_t crc, uint8_t c)
+{
+	return uart_crc_update(crc, c);
+}
+#endif
+
+// Flow control only ever applies to the state of IUART_FLOW_PORT, RS-485 to
+// that of IUART_RS485_PORT, silence framing to IUART_RTU_PORT; in the ISRs p
+// is a constant, so the tests are resolved at compile time.
+#define UART_PORT_STATE_(n)			iuart_port##n
+#define UART_PORT_STATE(n)			UART_PORT_STATE_(n)
+
+#if IUART_RS485
+#define UART_RS485(p)				((p) == &UART_PORT_STATE(IUART_RS485_PORT))
+#endif
+
+#if IUART_RTU
+#define UART_RTU(p)					((p) == &UART_PORT_STATE(IUART_RTU_PORT))
+// Timer1 clock select for IUART_RTU_PRESCALE
+#if IUART_RTU_PRESCALE == 1
+#define UART_RTU_CLOCK				_BV(CS10)
+#elif IUART_RTU_PRESCALE == 8
+#define UART_RTU_CLOCK				_BV(CS11)
+#elif IUART_RTU_PRESCALE == 64
+#define UART_RTU_CLOCK				(_BV(CS11) | _BV(CS10))
+#elif IUART_RTU_PRESCALE == 256
+#define UART_RTU_CLOCK				_BV(CS12)
+#else
+#define UART_RTU_CLOCK				(_BV(CS12) | _BV(CS10))
+#endif
+#else
+#define UART_RTU(p)					0
+#endif
+
+#if IUART_FLOW_CONTROL
+#define UART_FLOW(p)				((p) == &UART_PORT_STATE(IUART_FLOW_PORT))
+#define UART_RTS_IS_OFF()			(IUART_RTS_PORT & _BV(IUART_RTS_BIT))
+#define UART_CTS_IS_OFF()			(IUART_CTS_PIN & _BV(IUART_CTS_BIT))
+#else
+#define UART_FLOW(p)				0
+#endif
+
+// stdio streams carry their port number in the user data pointer, which
+// defaults to NULL, i.e. port 0
+#define IUART_STREAM_PORT(stream)	((uint8_t)(uintptr_t)fdev_get_udata(stream))
+
+void iuart_init(uint8_t port)
+{
+	iuart_port_t *p = iuart_state(port);
+	iuart_regs_t *r = iuart_regs(port);
+
 	// init buffer data structures
-	UartBuffer[0] = '\0';						// clear the first byte of buffer
-   	UartBufferNextByteToSend = 0; 				// set "next byte to send" to beginning
-   	UartBufferNextFree = 0; 					// next free byte is also beginning of buffer
-   	UartSendingInProgress = 0; 					// clear "sending in progress" flag 
+	p->tx_next_to_send = 0; 					// set "next byte to send" to beginning
+	p->tx_next_free = 0; 						// next free byte is also beginning of buffer
+	p->sending_in_progress = 0; 				// clear "sending in progress" flag
+#if IUART_TX_PRIO
+	p->prio_next_to_send = 0;					// nothing from interrupt context either
+	p->prio_next_free = 0;
+#endif
+	p->rx_next_to_read = 0;						// receive buffer starts out empty
+	p->rx_next_free = 0;
+	p->rx_status = 0;							// no receive errors seen yet
+	p->tx_policy = UART_TX_POLICY;				// default behaviour on a full output buffer
+#if IUART_TX_BUFFERS
+	p->seg_next_to_send = 0;					// no buffers handed over
+	p->seg_next_free = 0;
+	p->seg_left = 0;
+	p->seg_done = 0;
+#endif
+#if IUART_MULTIDROP
+	p->multidrop = IUART_MULTIDROP_OFF;			// plain 8-bit frames by default
+#endif
+#if IUART_XONXOFF
+	p->xonxoff = 0;								// no software flow control by default
+	p->rx_stopped = 0;
+	p->tx_stopped = 0;
+	p->tx_control = 0;
+#endif
+#if IUART_XONXOFF || IUART_TX_PRIO
+	p->tx_locked = 0;
+#endif
+#if IUART_CRC
+	p->tx_crc = IUART_CRC_INIT;
+#endif
+#if IUART_COOKED
+	p->mode = IUART_MODE;						// default text processing
+#endif
+	p->line_next = 0;							// no line handed out yet
+	p->line_len = 0;
+	p->line_shown = 0;
+	p->line_keep = 0;
+	p->line_echo = 0;
+	p->line_ready = 0;
+#if IUART_LINE_MODE
+	p->line_mode = 0;							// lines are assembled by uart_getchar() by default
+#endif
+#if IUART_FRAMES
+	p->frame_mode = IUART_FRAME_OFF;			// bytes are handed out one by one by default
+#endif
+	memset(&p->counters, 0, sizeof(p->counters));
+#if IUART_INSTRUMENT
+	memset(&p->stats, 0, sizeof(p->stats));
+#if IUART_INSTRUMENT_TIMER1
+	TCCR1A = 0;									// Timer1 free-running at the CPU clock,
+	TCCR1B = _BV(CS10);							// so one tick is one cycle
+#endif
+#if defined (IUART_PROBE_PORT)
+	IUART_PROBE_DDR |= _BV(IUART_PROBE_BIT);
+#endif
+#endif
+
+#if IUART_RS485
+	if (UART_RS485(p))
+	{
+		IUART_DE_PORT &= ~_BV(IUART_DE_BIT);	// bus released until there is something to send
+		IUART_DE_DDR |= _BV(IUART_DE_BIT);
+	}
+#endif
+#if IUART_RTU
+	if (UART_RTU(p))
+	{
+		TIMSK1 &= ~_BV(OCIE1B);					// no frame being timed
+		TCCR1A = 0;								// Timer1 free-running for the silence timer
+		TCCR1B = UART_RTU_CLOCK;
+	}
+#endif
+#if IUART_FLOW_CONTROL
+	if (UART_FLOW(p))
+	{
+		IUART_RTS_PORT &= ~_BV(IUART_RTS_BIT);	// ready to receive
+		IUART_RTS_DDR |= _BV(IUART_RTS_BIT);
+		PCICR |= _BV(IUART_CTS_PCIE);			// CTS pin change interrupts, armed while output is paused
+	}
+#endif
+
+	// the registers are assigned, not OR-ed into, so that initialising a port
+	// again leaves nothing behind from an earlier format or multidrop mode
+	r->ucsrb = _BV(TXEN0) | _BV(RXEN0); 		// Turn on the transmission and reception circuitry
+	r->ucsrc = IUART_FORMAT;				 	// Default frame format, 8N1 unless configured otherwise
+	r->ucsra = 0;								// No MPCM0; writing 0 leaves the TXC0 flag alone
+	iuart_set_baud(port, USART_BAUDRATE);		// Load UBRR and U2X for the default baud rate
+	r->ucsrb |= _BV(RXCIE0) | _BV(TXCIE0); 		// Enable the USART Receive and Transmit Complete interrupt (USART_RXC)
+												// Data Register Empty (UDRIE0) is only enabled while there is data to send
+}
+
+void init_iuart(void)
+{
+	iuart_init(0);
+}
+
+// Computes the UBRR value for a baud rate with the given number of clocks per
+// bit sample period (16 in normal mode, 8 with U2X), and the resulting error
+// in 0.01% units. Returns 0 if the rate can't be reached with a 12-bit UBRR.
+static uint8_t uart_baud_divisor(uint32_t baud, uint8_t clocks, uint16_t *ubrr, int16_t *error)
+{
+   uint32_t div, scaled;
+
+   if (baud == 0)
+      return 0;
+
+   div = (F_CPU + (uint32_t)clocks * baud / 2) / ((uint32_t)clocks * baud);	// rounded UBRR + 1
+   if (div == 0 || div > 4096)
+      return 0;
+
+   // error = F_CPU / (clocks * div * baud) - 1, scaled to 0.01% units; the
+   // denominator is divided by 10000 first so everything stays within 32 bits
+   scaled = ((uint32_t)clocks * div * baud + 5000) / 10000;
+   *ubrr = div - 1;
+   *error = ((int32_t)F_CPU - (int32_t)((uint32_t)clocks * div * baud)) / (int32_t)scaled;
+   return 1;
+}
+
+#if IUART_RTU
+// Works out the silence that ends a frame on IUART_RTU_PORT, in Timer1 ticks:
+// 3.5 characters of start, data, parity and stop bits, plus the 9th bit on a
+// multidrop bus, or the fixed 1750us Modbus asks for above 19200 baud.
+static void uart_rtu_timing(uint8_t port)
+{
+   iuart_port_t *p = iuart_state(port);
+   iuart_regs_t *r = iuart_regs(port);
+   uint8_t format = r->ucsrc, bits;
+   uint32_t ticks;
+
+   if (!UART_RTU(p) || p->baud == 0)
+      return;
+
+   bits = 1 + 5 + ((format & IUART_DATA8) >> 1) + 1;
+   if (format & IUART_PARITY_EVEN)
+      bits++;
+   if (format & IUART_STOP2)
+      bits++;
+   if (r->ucsrb & _BV(UCSZ02))
+      bits++;
+
+   if (p->baud > 19200)
+      ticks = (F_CPU / IUART_RTU_PRESCALE) * 7 / 4000;
+   else
+      ticks = (F_CPU / IUART_RTU_PRESCALE) * 7 * bits / (2 * p->baud);
+   p->rtu_gap = ticks > UINT16_MAX ? UINT16_MAX : ticks ? ticks : 1;
+}
+#else
+#define uart_rtu_timing(port)
+#endif
+
+// Programs a new baud rate, choosing between normal and double speed (U2X)
+// mode, whichever gets closer to the requested rate. Normal mode wins a tie,
+// because it samples each bit more times.
+//
+// Bytes still being sent are given time to go out at the old speed first,
+// unless interrupts are disabled. Received bytes in flight may be lost.
+//
+// Returns the error of the achieved rate in 0.01% units (e.g. 350 for +3.5%),
+// or INT16_MAX if the rate can't be generated from F_CPU at all, in which case
+// nothing is changed. Anything beyond about +-200 (2%) is unlikely to work.
+//
+int16_t iuart_set_baud(uint8_t port, uint32_t baud)
+{
+   iuart_port_t *p = iuart_state(port);
+   iuart_regs_t *r = iuart_regs(port);
+   uint16_t ubrr, ubrr2x;
+   int16_t error, error2x;
+   uint8_t normal, doubled;
+
+   normal = uart_baud_divisor(baud, 16, &ubrr, &error);
+   doubled = uart_baud_divisor(baud, 8, &ubrr2x, &error2x);
+
+   if (!normal && !doubled)
+      return INT16_MAX;
+
+   if (!normal || (doubled && abs(error2x) < abs(error)))
+   {
+      ubrr = ubrr2x;
+      error = error2x;
+   }
+   else
+      doubled = 0;
+
+   // let queued output drain at the speed it was meant for
+   iuart_flush(port);
+
+   // writing 0 leaves the TXC0 flag alone; only MPCM0 needs preserving
+   r->ucsra = (r->ucsra & _BV(MPCM0)) | (doubled ? _BV(U2X0) : 0);
+   r->ubrrh = ubrr >> 8; 						// Load upper 8-bits of the baud rate value into the high byte of the UBRR register
+   r->ubrrl = ubrr;								// Load lower 8-bits last, this updates the baud rate prescaler
+   p->baud = baud;
+   uart_rtu_timing(port);
+
+   return error;
+}
+
+uint32_t iuart_get_baud(uint8_t port)
+{
+   return iuart_state(port)->baud;
+}
+
+// Programs a new frame format: IUART_DATAn, IUART_PARITY_x and IUART_STOPn
+// OR-ed together, or one of the shorthands like IUART_7E1. UCSRnC is written
+// as a whole, so nothing of the previous format survives.
+//
+// As with iuart_set_baud(), bytes still being sent go out in the old format
+// first unless interrupts are disabled, and received bytes in flight may be
+// lost. With parity enabled, bytes that fail the check are dropped by the RX
+// interrupt, counted in rx_parity and reported to uart_getchar() as _FDEV_ERR.
+//
+// Returns EOF, changing nothing, for an invalid format, or for anything but
+// 8 data bits while the port is in a 9-bit multidrop mode.
+//
+int iuart_config(uint8_t port, uint8_t format)
+{
+   if ((format & ~IUART_FORMAT_MASK) != 0 || (format & IUART_PARITY_ODD) == 0x10)
+      return EOF;								// UPMn1:0 = 01 is reserved
+#if IUART_MULTIDROP
+   if (iuart_state(port)->multidrop != IUART_MULTIDROP_OFF && (format & IUART_DATA8) != IUART_DATA8)
+      return EOF;
+#endif
+
+   iuart_flush(port);
+   iuart_regs(port)->ucsrc = format;
+   uart_rtu_timing(port);
+   return 0;
+}
+
+uint8_t iuart_get_config(uint8_t port)
+{
+   return iuart_regs(port)->ucsrc & IUART_FORMAT_MASK;
+}
+
+#if IUART_AUTOBAUD
+// Rates iuart_autobaud() picks from, in units of 100 baud
+static const uint16_t uart_autobaud_rates[] PROGMEM =
+{
+   24, 48, 96, 144, 192, 288, 384, 576, 768, 1152, 2304, 2500
+};
+
+// Longest 'U', from its first falling edge to its last, at the slowest rate
+// and with a bit to spare, in CPU cycles
+#define UART_AUTOBAUD_SPAN_MAX		(F_CPU / 2400 * 9)
+
+// The measurement, kept by the Timer1 input capture and overflow interrupts.
+// Times are in CPU cycles, Timer1 extended with its overflows.
+static struct
+{
+   uint16_t start;							// Timer1 when iuart_autobaud() started
+   volatile uint16_t high;					// Timer1 overflows since then
+   uint8_t edges;							// falling edges in fall[], up to 5
+   uint32_t fall[5];						// the last ones, oldest first
+   volatile uint32_t span;					// first to fifth edge of a 'U', 0 = none yet
+} uart_autobaud;
+
+// Time of the Timer1 count t, read just now, since iuart_autobaud() started.
+// An overflow that is pending but not counted yet came before t if t is from
+// early in the count. Called with interrupts disabled.
+static uint32_t uart_autobaud_time(uint16_t t)
+{
+   uint16_t high = uart_autobaud.high;
+
+   if ((TIFR1 & _BV(TOV1)) && t < 0x8000)
+      high++;
+   return ((uint32_t)high << 16 | t) - uart_autobaud.start;
+}
+
+// Takes one falling edge captured on ICP1. A 'U' falls at the start of its
+// start bit and of bits 2, 4, 6 and 8, so five edges in a row two bits apart,
+// each within a quarter bit of where it belongs, make one, spanning 8 bits.
+// The check only takes shifts and subtractions, as it runs at every edge.
+static inline __attribute__((always_inline)) void uart_autobaud_edge(uint16_t icr)
+{
+   uint32_t *f = uart_autobaud.fall, span, slack, gap;
+   uint8_t k;
+
+   if (uart_autobaud.edges == 5)
+   {
+      for (k = 0; k < 4; k++)
+         f[k] = f[k + 1];
+      uart_autobaud.edges = 4;
+   }
+   f[uart_autobaud.edges++] = uart_autobaud_time(icr);
+   if (uart_autobaud.edges < 5)
+      return;
+
+   span = f[4] - f[0];
+   if (span > UART_AUTOBAUD_SPAN_MAX)
+      return;
+   slack = span >> 3;							// a quarter bit, times 4
+   for (k = 0; k < 4; k++)
+   {
+      gap = (f[k + 1] - f[k]) << 2;
+      if (gap > span + slack || gap + slack < span)
+         return;
+   }
+   uart_autobaud.span = span;
+   TIMSK1 &= ~(_BV(ICIE1) | _BV(TOIE1));		// done
+}
+
+/*
+ * Measures a 'U' sent by the peer and programs the standard rate
+ * closest to it, if that is within 5%.  Other characters, and a 'U'
+ * caught halfway, are rejected by the edge checks and the next one is
+ * tried, until timeout_ms is up.
+ *
+ * The falling edges are timestamped by the Timer1 input capture unit,
+ * so ICP1 has to be wired to the port's RXD, and the time they take the
+ * interrupt to handle doesn't matter; the CPU waits for them in idle
+ * sleep with interrupts enabled.  Timer1 is run free at the CPU clock
+ * meanwhile, its interrupts masked but for the input capture and
+ * overflow ones, which are taken over, and it is given back as it was.
+ *
+ * The receiver is off while measuring, so the 'U' itself doesn't end up
+ * in the receive buffer; what was received before is left there.
+ * Returns 0 without waiting if interrupts are disabled.
+ */
+uint32_t iuart_autobaud(uint8_t port, uint16_t timeout_ms)
+{
+   iuart_port_t *p = iuart_state(port);
+   iuart_regs_t *r = iuart_regs(port);
+   uint32_t limit = (uint32_t)timeout_ms * (F_CPU / 1000);
+   uint32_t span, measured, rate, baud = 0, best = UINT32_MAX, error;
+   uint8_t tccr1a, tccr1b, timsk1, i;
+
+   if (p != &UART_PORT_STATE(IUART_AUTOBAUD_PORT) || !(SREG & _BV(SREG_I)))
+      return 0;
+
+   ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+   {
+      tccr1a = TCCR1A;
+      tccr1b = TCCR1B;
+      timsk1 = TIMSK1;
+      TIMSK1 = 0;
+      TCCR1A = 0;
+      TCCR1B = _BV(ICNC1) | _BV(CS10);		// falling edges, noise canceler on
+      TIFR1 = _BV(ICF1) | _BV(TOV1);
+      r->ucsrb &= ~_BV(RXEN0);
+
+      uart_autobaud.start = TCNT1;
+      uart_autobaud.high = 0;
+      uart_autobaud.edges = 0;
+      uart_autobaud.span = 0;
+      TIMSK1 = _BV(ICIE1) | _BV(TOIE1);
+   }
+
+   IUART_SLEEP_UNTIL(uart_autobaud.span != 0 || uart_autobaud_time(TCNT1) > limit);
+
+   ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+   {
+      TIMSK1 = 0;
+      span = uart_autobaud.span;
+      r->ucsrb |= _BV(RXEN0);
+      TCCR1A = tccr1a;
+      TCCR1B = tccr1b;
+      TIFR1 = _BV(ICF1) | _BV(TOV1);
+      TIMSK1 = timsk1;
+   }
+   if (span == 0)
+      return 0;
+
+   measured = (F_CPU * 8 + span / 2) / span;
+   for (i = 0; i < sizeof(uart_autobaud_rates) / sizeof(uart_autobaud_rates[0]); i++)
+   {
+      rate = pgm_read_word(&uart_autobaud_rates[i]) * 100UL;
+      error = measured > rate ? measured - rate : rate - measured;
+      error = error * 1000 / rate;					// in 0.1% units
+      if (error < best)
+      {
+         best = error;
+         baud = rate;
+      }
+   }
+   if (best > 50)
+      return 0;
 
-	UCSR0B |= _BV(TXEN0) | _BV(RXEN0); 			// Turn on the transmission and reception circuitry
-   	UCSR0C |= _BV(UCSZ00) | _BV(UCSZ01);	 	// Use 8-bit character sizes
-	UBRR0H = (BAUD_PRESCALE >> 8); 				// Load upper 8-bits of the baud rate value into the high byte of the UBRR register
-	UBRR0L = BAUD_PRESCALE;						// Load lower 8-bits of the baud rate value into the low byte of the UBRR register
-	UCSR0B |= _BV(RXCIE0) | _BV(TXCIE0); 		// Enable the USART Receive and Transmit Complete interrupt (USART_RXC)
+   iuart_set_baud(port, baud);
+   return baud;
+}
+#endif
+
+void iuart_set_tx_policy(uint8_t port, uint8_t policy)
+{
+	iuart_state(port)->tx_policy = policy;
+}
+
+// Copies the counters with interrupts disabled, so they are consistent.
+void iuart_get_counters(uint8_t port, iuart_counters_t *counters)
+{
+	iuart_port_t *p = iuart_state(port);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		*counters = p->counters;
+	}
+}
+
+#if IUART_INSTRUMENT
+// Copies the ISR timing statistics with interrupts disabled and fills in the
+// averages.
+void iuart_stats(uint8_t port, iuart_stats_t *stats)
+{
+	iuart_port_t *p = iuart_state(port);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		*stats = p->stats;
+	}
+	stats->rx.avg = stats->rx.count ? stats->rx.total / stats->rx.count : 0;
+	stats->udre.avg = stats->udre.count ? stats->udre.total / stats->udre.count : 0;
+	stats->tx.avg = stats->tx.count ? stats->tx.total / stats->tx.count : 0;
+}
+
+void iuart_stats_reset(uint8_t port)
+{
+	iuart_port_t *p = iuart_state(port);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		memset(&p->stats, 0, sizeof(p->stats));
+	}
+}
+#endif
+
+void iuart_reset_counters(uint8_t port)
+{
+	iuart_port_t *p = iuart_state(port);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		memset(&p->counters, 0, sizeof(p->counters));
+	}
+}
+
+#if IUART_CRC
+iuart_crc_t iuart_tx_crc(uint8_t port)
+{
+	return iuart_state(port)->tx_crc;
+}
+
+void iuart_tx_crc_reset(uint8_t port)
+{
+	iuart_state(port)->tx_crc = IUART_CRC_INIT;
+}
+
+#endif
+
+#if IUART_COOKED
+void iuart_set_mode(uint8_t port, uint8_t mode)
+{
+	iuart_state(port)->mode = mode;
+}
+
+uint8_t iuart_get_mode(uint8_t port)
+{
+	return iuart_state(port)->mode;
+}
+
+#endif
+
+uint8_t iuart_tx_busy(uint8_t port)
+{
+	return iuart_state(port)->sending_in_progress;
+}
+
+// Waits in idle sleep until the last queued byte has left the shift register,
+// as reported by the TX Complete interrupt. Returns EOF without waiting if
+// interrupts are disabled and output is still pending.
+int iuart_flush(uint8_t port)
+{
+	iuart_port_t *p = iuart_state(port);
+
+	if (!p->sending_in_progress)
+		return 0;
+	if (!(SREG & _BV(SREG_I)))
+		return EOF;
+
+	IUART_SLEEP_UNTIL(!p->sending_in_progress);
+	return 0;
+}
+
+// The USARTs stop in the deeper sleep modes, so the application may only go
+// beyond idle sleep while this returns 0. Bytes still waiting to be read
+// don't count: they are safe in the receive buffers.
+uint8_t iuart_busy(void)
+{
+	uint8_t busy = 0;
+
+#if IUART_USE_USART0
+	if (iuart_port0.sending_in_progress)
+		busy |= 1 << 0;
+#endif
+#if IUART_USE_USART1
+	if (iuart_port1.sending_in_progress)
+		busy |= 1 << 1;
+#endif
+#if IUART_USE_USART2
+	if (iuart_port2.sending_in_progress)
+		busy |= 1 << 2;
+#endif
+#if IUART_USE_USART3
+	if (iuart_port3.sending_in_progress)
+		busy |= 1 << 3;
+#endif
+	return busy;
+}
+
+// Masks the interrupts that may touch the output buffer while it is being
+// updated: the Data Register Empty interrupt, and in line mode also the RX
+// interrupt, which echoes into the buffer; copies are then kept short, see
+// iuart_write(). With XON/XOFF the RX interrupt stays enabled: it sees
+// tx_locked and leaves restarting output to uart_tx_unlock(), as does
+// iuart_try_write() from other interrupts. Returns the previous state of the
+// masked bits for uart_tx_unlock().
+static inline uint8_t uart_tx_lock(iuart_port_t *p, iuart_regs_t *r)
+{
+   uint8_t mask = _BV(UDRIE0);
+   uint8_t ucsrb;
+
+#if IUART_FLOW_CONTROL
+   // the CTS interrupt resumes output, so it is masked as well; if output
+   // is still paused, the Data Register Empty interrupt enabled on unlock
+   // finds CTS high and arms it again
+   if (UART_FLOW(p))
+      IUART_CTS_PCMSK &= ~_BV(IUART_CTS_PCINT);
+#endif
+#if IUART_LINE_MODE
+   if (p->line_mode)
+      mask |= _BV(RXCIE0);
+#endif
+   UART_UCSRB_ATOMIC()
+   {
+      ucsrb = r->ucsrb;
+      r->ucsrb = ucsrb & ~mask;
+#if IUART_XONXOFF || IUART_TX_PRIO
+      p->tx_locked = 1;
+#endif
+   }
+#if IUART_INSTRUMENT
+   p->lock_start = uart_timestamp();
+#endif
+   return ucsrb & mask;
+}
+
+// Undoes uart_tx_lock(), enabling the Data Register Empty interrupt if there
+// is anything to send, an XON or XOFF queued meanwhile included.
+static inline void uart_tx_unlock(iuart_port_t *p, iuart_regs_t *r, uint8_t saved)
+{
+#if IUART_INSTRUMENT
+   uint16_t masked = uart_timestamp() - p->lock_start;
+
+   if (masked > p->stats.max_masked)
+      p->stats.max_masked = masked;
+#endif
+   saved &= ~_BV(UDRIE0);
+   UART_UCSRB_ATOMIC()
+   {
+#if IUART_XONXOFF || IUART_TX_PRIO
+      p->tx_locked = 0;
+#endif
+#if IUART_XONXOFF
+      if (p->tx_control)
+         saved |= _BV(UDRIE0);
+#endif
+      if (UART_TX_PENDING(p))
+         saved |= _BV(UDRIE0);
+      r->ucsrb |= saved;
+   }
+}
+
+// Returns the number of bytes that can still be queued in the output buffer.
+// One byte is always kept unused so a full buffer doesn't look empty.
+static uart_tx_index_t uart_tx_space(iuart_port_t *p)
+{
+   uart_tx_index_t tail;
+
+   UART_TX_INDEX_ATOMIC()
+   {
+      tail = p->tx_next_to_send;
+   }
+   return (tail - p->tx_next_free - 1) & UART_BUFFER_MASK;
+}
+
+// Sets the "sending in progress" flag, which the TX Complete interrupt clears
+// once the line is idle again. On the RS-485 port this also enables the bus
+// driver, before the Data Register Empty interrupt can send the first byte.
+static inline void uart_tx_start(iuart_port_t *p)
+{
+   p->sending_in_progress = 1;
+#if IUART_RS485
+   if (UART_RS485(p))
+      IUART_DE_PORT |= _BV(IUART_DE_BIT);
+#endif
+}
+
+// Records the output buffer fill level, after bytes were queued.
+static inline void uart_tx_mark(iuart_port_t *p)
+{
+   uart_tx_index_t used = UART_BUFFER_MASK - uart_tx_space(p);
+
+   if (used > p->counters.tx_high_water)
+      p->counters.tx_high_water = used;
+}
+
+// Discards the n oldest bytes still waiting in the output buffer.
+// Must be called with the output buffer locked.
+static void uart_tx_drop(iuart_port_t *p, uart_tx_index_t n)
+{
+#if IUART_TX_BUFFERS
+   uint8_t i = p->seg_next_to_send;
+
+   // buffers due within the dropped bytes go out right after them instead
+   if (p->seg_left)
+      i++;									// already being sent
+   for (; i != p->seg_next_free; i++)
+      if (((p->seg[i & (IUART_TX_BUFFERS - 1)].at - p->tx_next_to_send) & UART_BUFFER_MASK) < n)
+         p->seg[i & (IUART_TX_BUFFERS - 1)].at = (p->tx_next_to_send + n) & UART_BUFFER_MASK;
+#endif
+   p->tx_next_to_send = (p->tx_next_to_send + n) & UART_BUFFER_MASK;
+   p->counters.tx_overwritten += n;
+}
+
+// Puts the CPU in idle sleep until the Data Register Empty interrupt has made
+// room in the output buffer. The buffer is full, so the interrupt is enabled
+// and keeps waking us up once per byte sent.
+//
+// Returns EOF without waiting if interrupts are disabled (e.g. when called from
+// an interrupt handler), because then nothing would ever drain the buffer.
+//
+static int uart_tx_wait(iuart_port_t *p)
+{
+   if (!(SREG & _BV(SREG_I)))
+      return EOF;
+
+   p->counters.tx_blocked++;
+   IUART_SLEEP_UNTIL(uart_tx_space(p) != 0);
+
+   return 0;
+}
+
+// Adds a character to the UART output buffer and makes sure the Data
+// Register Empty interrupt is enabled, so it gets sent as soon as UDRn
+// has room for it.
+//
+// The send buffer is a wrap-around buffer.
+//
+// If the buffer is full, the port's policy decides what happens: UART_TX_BLOCK
+// sleeps until there is room, UART_TX_FAIL returns EOF and UART_TX_DROP_OLDEST
+// throws away the oldest unsent byte to make room for this one. A blocking
+// call made with interrupts disabled behaves like UART_TX_FAIL.
+// A successful completion returns 0.
+//
+// This routine disables the UART Data Register Empty interrupt temporarily
+// (and the RX interrupt, in line mode), because things would get funky if the
+// interrupt signal routine were called during execution of this routine.
+//
+// Because UDRn is double-buffered, the interrupt reloads it while the previous
+// character is still being shifted out, so consecutive characters go out
+// back-to-back with no idle time between them.
+//
+static int uart_put(iuart_port_t *p, iuart_regs_t *r, char c)
+{
+   register int ReturnStatus = 0; 			// return 0 for success
+   register uart_tx_index_t next_free; 	// where tx_next_free goes after this byte
+   uint8_t saved;
+   uint8_t wait = p->tx_policy == UART_TX_BLOCK;
+
+   for (;;)
+   {
+      // wait for room while the interrupt is still enabled to make it
+      if (wait && uart_tx_space(p) == 0 && uart_tx_wait(p) == EOF)
+         wait = 0;								// interrupts disabled, fail instead
+
+      // disable the interrupts that touch the output buffer
+      saved = uart_tx_lock(p, r);
+
+      // compute the next free byte index, wrapping around at the end of the buffer
+      next_free = (p->tx_next_free + 1) & UART_BUFFER_MASK;
+
+      // the line mode echo may have taken the room again before the lock
+      if (!wait || next_free != p->tx_next_to_send)
+         break;
+      uart_tx_unlock(p, r, saved);
+   }
+
+   if (next_free == p->tx_next_to_send) // if buffer is full -
+   {
+      if (p->tx_policy == UART_TX_DROP_OLDEST)
+         uart_tx_drop(p, 1);					// make room by discarding the oldest byte
+      else
+      {
+         // return with error code
+         ReturnStatus = EOF;
+         p->counters.tx_failed++;
+      }
+   }
+
+   if (ReturnStatus == 0)
+   {
+      p->tx_buffer[p->tx_next_free] = c;
+      IUART_BARRIER();
+      UART_TX_INDEX_ATOMIC()
+      {
+         p->tx_next_free = next_free;
+      }
+      // set "sending in progress" flag, the TX Complete interrupt clears it
+      uart_tx_start(p);
+      uart_tx_mark(p);
+   }
+
+   // enable the Data Register Empty interrupt, if there is anything to send
+   uart_tx_unlock(p, r, saved);
+
+   // return with status code
+   return ReturnStatus;
+}
+
+// Queues one character, adding a carriage return before each newline if the
+// port has IUART_ONLCR set. In a raw build this is just uart_put().
+static inline int uart_putc(iuart_port_t *p, iuart_regs_t *r, char c)
+{
+   // if character is a "newline" then add a "carriage return" before it.
+   if (c == '\n' && UART_MODE(p, IUART_ONLCR))
+      uart_put(p, r, '\r');
+
+   return uart_put(p, r, c);
+}
+
+int iuart_putc(uint8_t port, char c)
+{
+   return uart_putc(iuart_state(port), iuart_regs(port), c);
+}
+
+int iuart_putchar(char c, FILE *stream)
+{
+   return iuart_putc(IUART_STREAM_PORT(stream), c);
+}
+
+int UART0_Putchar(char c, FILE *stream)
+{
+   return iuart_putc(0, c);
+}
+
+#if IUART_TX_PRIO
+/*
+ * Output from other interrupt handlers goes through a ring of its own,
+ * with a single producer, interrupt context, which AVR interrupts don't
+ * nest into, and a single consumer, the Data Register Empty interrupt.
+ * Each side only ever writes its own index, a single byte, and reads
+ * the other's; the data is stored before the index that hands it over
+ * is published, under IUART_BARRIER(), so nothing needs masking.  The
+ * only shared register bit, UDRIE0, is set here and read-modify-written
+ * with interrupts disabled everywhere else, see UART_UCSRB_ATOMIC().
+ * While the main line holds uart_tx_lock(), it is left to
+ * uart_tx_unlock() to set, which looks at this ring as well.
+ *
+ * The ring bypasses the port's policy (a full ring fails), its text
+ * processing, the output buffer and any handed over buffers: the bytes
+ * go out as they are, between two bytes of whatever else is being sent,
+ * so keep them to ports where that is harmless, such as a diagnostic
+ * console.  They are still subject to CTS and XOFF.
+ */
+int iuart_try_write(uint8_t port, const uint8_t *buf, uint8_t len)
+{
+   iuart_port_t *p = iuart_state(port);
+   uint8_t head = p->prio_next_free;
+   uint8_t space = (p->prio_next_to_send - head - 1) & UART_PRIO_MASK;
+
+   if (len > space)
+   {
+      p->counters.tx_prio_failed += len;
+      return EOF;
+   }
+
+   while (len--)
+   {
+      p->prio_buffer[head] = *buf++;
+      head = (head + 1) & UART_PRIO_MASK;
+   }
+   IUART_BARRIER();
+   p->prio_next_free = head;
+   uart_tx_start(p);
+   if (!p->tx_locked)
+      iuart_regs(port)->ucsrb |= _BV(UDRIE0);
+   return 0;
+}
+
+int iuart_try_putc(uint8_t port, char c)
+{
+   return iuart_try_write(port, (const uint8_t *)&c, 1);
+}
+#endif
+
+// Copies bytes into the output buffer. With IUART_CRC this is a plain loop
+// instead of memcpy(), adding each byte to the running CRC on the way.
+static inline void uart_tx_copy(iuart_port_t *p, char *dst, const uint8_t *src, size_t n)
+{
+#if IUART_CRC
+   iuart_crc_t crc = p->tx_crc;
+
+   while (n--)
+   {
+      crc = uart_crc_update(crc, *src);
+      *dst++ = *src++;
+   }
+   p->tx_crc = crc;
+#else
+   memcpy(dst, src, n);
+#endif
+}
+
+// Copies as much of a block as fits into the output buffer, inside a single
+// locked section of the output buffer, with at most two copies:
+// one up to the end of the wrap-around buffer and one from its beginning.
+//
+// With UART_TX_DROP_OLDEST, old bytes are discarded until the block fits; len
+// must then not exceed UART_BUFFER_SIZE - 1.
+//
+// Returns the number of bytes copied.
+//
+static size_t uart_write_block(iuart_port_t *p, iuart_regs_t *r, const uint8_t *buf, size_t len)
+{
+   uart_tx_index_t head, space;
+   size_t chunk;
+   uint8_t saved;
+
+   // disable the interrupts that touch the output buffer
+   saved = uart_tx_lock(p, r);
+
+   space = uart_tx_space(p);
+   if (len > (size_t)space)
+   {
+      if (p->tx_policy == UART_TX_DROP_OLDEST)
+         uart_tx_drop(p, len - space);
+      else
+         len = space;
+   }
+
+   // first copy, up to the end of the buffer
+   head = p->tx_next_free;
+   chunk = UART_BUFFER_SIZE - head;
+   if (chunk > len)
+      chunk = len;
+   uart_tx_copy(p, &p->tx_buffer[head], buf, chunk);
+
+   // second copy, wrapped around to the beginning
+   if (len > chunk)
+      uart_tx_copy(p, &p->tx_buffer[0], buf + chunk, len - chunk);
+
+   IUART_BARRIER();
+   UART_TX_INDEX_ATOMIC()
+   {
+      p->tx_next_free = (head + len) & UART_BUFFER_MASK;
+   }
+
+   if (len)
+   {
+      uart_tx_start(p);
+      uart_tx_mark(p);
+   }
+
+   // enable the Data Register Empty interrupt, if there is anything to send
+   uart_tx_unlock(p, r, saved);
+
+   return len;
+}
+
+#if IUART_TX_BUFFERS
+/*
+ * Hands a buffer, made of up to IUART_TX_IOV segments, over to the Data
+ * Register Empty interrupt.  It sends the segments straight from where
+ * they are, in RAM or flash, once the output buffer has been sent up to
+ * where it stands now, and carries on with the output buffer after
+ * them.  Only the segment descriptors and the position are recorded,
+ * and the descriptors are copied into the free slot before the
+ * interrupt is masked, so the time spent masked doesn't depend on the
+ * lengths, nor on the number of segments.
+ *
+ * When a buffer is done, the interrupt frees its slot and calls the
+ * routine set with iuart_set_tx_done(), from interrupt context.  The
+ * last bytes may still be in the USART then, see iuart_flush().
+ *
+ * Returns 0, or EOF if there are too many segments, or no free slot and
+ * the port's policy doesn't let us wait for one.
+ */
+static int uart_writev(uint8_t port, const iuart_iovec_t *iov, uint8_t iovcnt, uint8_t onlcr)
+{
+   iuart_port_t *p = iuart_state(port);
+   iuart_regs_t *r = iuart_regs(port);
+   uint8_t saved, slot, i, n;
+   uint32_t len = 0;
+
+   if (iovcnt > IUART_TX_IOV)
+      return EOF;
+   for (i = 0; i < iovcnt; i++)
+      len += iov[i].len;
+   if (len == 0)
+      return 0;
+
+   if (iuart_buffers_pending(port) == IUART_TX_BUFFERS)
+   {
+      if (p->tx_policy != UART_TX_BLOCK || !(SREG & _BV(SREG_I)))
+      {
+         p->counters.tx_failed += len;
+         return EOF;
+      }
+      p->counters.tx_blocked++;
+      IUART_SLEEP_UNTIL(iuart_buffers_pending(port) < IUART_TX_BUFFERS);
+   }
+
+   // the free slot isn't looked at by the interrupt until it is published
+   slot = p->seg_next_free;
+   for (i = 0, n = 0; i < iovcnt; i++)
+      if (iov[i].len)
+         p->seg[slot & (IUART_TX_BUFFERS - 1)].iov[n++] = iov[i];
+   p->seg[slot & (IUART_TX_BUFFERS - 1)].iovcnt = n;
+#if IUART_COOKED
+   p->seg[slot & (IUART_TX_BUFFERS - 1)].onlcr = onlcr;
+#endif
+
+   saved = uart_tx_lock(p, r);
+   p->seg[slot & (IUART_TX_BUFFERS - 1)].at = p->tx_next_free;
+   IUART_BARRIER();
+   p->seg_next_free = slot + 1;
+   uart_tx_start(p);
+   uart_tx_unlock(p, r, saved);
+
+   return 0;
+}
+
+int iuart_writev(uint8_t port, const iuart_iovec_t *iov, uint8_t iovcnt)
+{
+   return uart_writev(port, iov, iovcnt, 0);
+}
+
+int iuart_send_buffer(uint8_t port, const uint8_t *buf, uint16_t len)
+{
+   iuart_iovec_t iov;
+
+   iov.base = buf;
+   iov.len = len;
+   iov.in_flash = 0;
+   return iuart_writev(port, &iov, 1);
+}
+
+uint8_t iuart_buffers_pending(uint8_t port)
+{
+   iuart_port_t *p = iuart_state(port);
+
+   return (uint8_t)(p->seg_next_free - p->seg_next_to_send);
+}
+
+void iuart_set_tx_done(uint8_t port, iuart_tx_done_t done)
+{
+   iuart_state(port)->seg_done = done;
+}
+
+#endif
+
+#if IUART_LINE_MODE
+// Bytes copied per masking of the RX interrupt in line mode, few enough for
+// the two byte receive FIFO of the USART to ride it out even at 1 Mbaud.
+#define UART_LINE_COPY		16
+#endif
+
+// Queues a block of bytes for transmission in one go.
+//
+// Unlike iuart_putc() the bytes are sent as they are, with no newline
+// translation, so this is the routine to use for binary data.
+//
+// A block that fits is copied with a single masking of the interrupt, or in
+// line mode, where that masks the RX interrupt too, UART_LINE_COPY bytes at a
+// time. When it doesn't fit, the port's policy decides: UART_TX_FAIL queues
+// only the bytes that fit, UART_TX_BLOCK sleeps and queues the rest as room is
+// made, and UART_TX_DROP_OLDEST discards old data (and, for a block larger
+// than the buffer, the start of the block itself) so the newest bytes are
+// kept.
+//
+// Returns the number of bytes accepted, which is only less than len with
+// UART_TX_FAIL (or UART_TX_BLOCK called with interrupts disabled).
+//
+size_t iuart_write(uint8_t port, const uint8_t *buf, size_t len)
+{
+   iuart_port_t *p = iuart_state(port);
+   iuart_regs_t *r = iuart_regs(port);
+   size_t done = 0, want, n;
+
+   // only the newest UART_BUFFER_SIZE - 1 bytes of a huge block can survive
+   if (p->tx_policy == UART_TX_DROP_OLDEST && len > UART_BUFFER_SIZE - 1)
+   {
+      done = len - (UART_BUFFER_SIZE - 1);
+      p->counters.tx_overwritten += done;
+   }
+
+   for (;;)
+   {
+      want = len - done;
+#if IUART_LINE_MODE
+      if (p->line_mode && want > UART_LINE_COPY)
+         want = UART_LINE_COPY;
+#endif
+      n = uart_write_block(p, r, buf + done, want);
+      done += n;
+      if (done == len)
+         break;
+      if (n == want)
+         continue;
+
+      if (p->tx_policy != UART_TX_BLOCK || uart_tx_wait(p) == EOF)
+      {
+         p->counters.tx_failed += len - done;
+         break;
+      }
+   }
+
+   return done;
+}
+
+size_t UART0_Write(const uint8_t *buf, size_t len)
+{
+   return iuart_write(0, buf, len);
+}
+
+// State of one iuart_printf() or iuart_frame_send() call. Characters are
+// stored straight into the free part of the output buffer, past tx_next_free,
+// where the interrupt doesn't look yet, so no masking is needed while
+// formatting.
+typedef struct
+{
+   iuart_port_t *p;
+   iuart_regs_t *r;
+   uart_tx_index_t head;		// where the next formatted character goes
+   uart_tx_index_t space;		// free bytes left past head
+   uint8_t direct;				// 0 = go through uart_put() for every character
+   uint8_t failed;				// the port's policy dropped a character
+   int count;					// characters produced
+} uart_fmt_t;
+
+static void uart_fmt_begin(uart_fmt_t *f, uint8_t port)
+{
+   f->p = iuart_state(port);
+   f->r = iuart_regs(port);
+   f->count = 0;
+   f->direct = 1;
+   f->failed = 0;
+#if IUART_LINE_MODE
+   // the RX interrupt echoes into the output buffer
+   if (f->p->line_mode)
+      f->direct = 0;
+#endif
+   f->head = f->p->tx_next_free;
+   f->space = f->direct ? uart_tx_space(f->p) : 0;
+}
+
+// Hands everything formatted so far to the interrupt with a single index update.
+static void uart_fmt_commit(uart_fmt_t *f)
+{
+   iuart_port_t *p = f->p;
+
+   if (!f->direct || f->head == p->tx_next_free)
+      return;
+
+   // the Data Register Empty interrupt may still be enabled, so the bytes
+   // are published, the port flagged busy and the interrupt enabled in one
+   // go; otherwise the TX Complete interrupt could see the bytes sent
+   // before the flag is set, or the flag set with the bytes already gone
+   IUART_BARRIER();
+   ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+   {
+      p->tx_next_free = f->head;
+      uart_tx_start(p);
+      f->r->ucsrb |= _BV(UDRIE0);
+   }
+   uart_tx_mark(p);
+}
+
+static void uart_fmt_raw(uart_fmt_t *f, char c)
+{
+   if (f->space)
+   {
+      f->p->tx_buffer[f->head] = c;
+      f->head = (f->head + 1) & UART_BUFFER_MASK;
+      f->space--;
+      return;
+   }
+
+   // out of room: publish what we have and let the port's policy handle
+   // this character like any other, then carry on after it
+   uart_fmt_commit(f);
+   if (uart_put(f->p, f->r, c) == EOF)
+      f->failed = 1;
+   if (f->direct)
+   {
+      f->head = f->p->tx_next_free;
+      f->space = uart_tx_space(f->p);
+   }
+}
+
+static void uart_fmt_put(uart_fmt_t *f, char c)
+{
+   f->count++;
+   if (c == '\n' && UART_MODE(f->p, IUART_ONLCR))
+      uart_fmt_raw(f, '\r');
+   uart_fmt_raw(f, c);
+}
+
+static void uart_fmt_pad(uart_fmt_t *f, char c, int16_t n)
+{
+   while (n-- > 0)
+      uart_fmt_put(f, c);
+}
+
+/*
+ * A small printf() for the common cases, formatting straight into the
+ * output buffer.  Supported conversions:
+ *
+ * . %d %i %u %x %X, with an optional l for long arguments
+ * . %c, %s (string in RAM) and %S (string in flash)
+ * . %% for a single %
+ *
+ * Each may have the - and 0 flags and a field width.  A precision on %s
+ * limits the characters printed.  A precision on %d, %i or %u prints
+ * the number as fixed point, with that many digits after the decimal
+ * point: printf("%.2d", 1234) gives "12.34", which is not what the C
+ * library does with it.  On %x and %X it is the minimum number of
+ * digits, as in C.  Integer precisions are clamped to what the digit
+ * buffer holds, 11 on AVR, more digits than a long has anyway.
+ * Floating point is not supported; anything unknown is printed as it
+ * is.
+ *
+ * Newlines get a carriage return added with IUART_ONLCR, like
+ * iuart_putc().  If the output buffer fills up, the port's policy
+ * applies to the rest of the message, character by character.  In line
+ * mode the RX interrupt also writes to the output buffer, so there every
+ * character goes through the locked single character path instead.
+ *
+ * Returns the number of characters produced, not counting the added
+ * carriage returns.
+ */
+// Longest width, precision and %s string uart_vformat() deals with
+#define UART_FMT_MAX				9999
+
+static int uart_vformat(uint8_t port, const char *fmt, uint8_t fmt_in_flash, va_list ap)
+{
+   uart_fmt_t f;
+   char digits[sizeof(unsigned long) * 3], *cp;	// a decimal long and a bit more
+   const char *str;
+   char c;
+   uint8_t left, zero, is_long, in_flash, base, neg;
+   int16_t width, prec, point, n, len;
+   unsigned long value;
+
+   uart_fmt_begin(&f, port);
+
+   for (;; fmt++)
+   {
+      c = fmt_in_flash ? pgm_read_byte(fmt) : *fmt;
+      if (c == '\0')
+         break;
+      if (c != '%')
+      {
+         uart_fmt_put(&f, c);
+         continue;
+      }
+
+      left = zero = is_long = 0;
+      width = 0;
+      prec = -1;
+      for (;;)
+      {
+         c = fmt_in_flash ? pgm_read_byte(++fmt) : *++fmt;
+         if (c == '-')
+            left = 1;
+         else if (c == '0')
+            zero = 1;
+         else
+            break;
+      }
+      // width and precision saturate at UART_FMT_MAX rather than wrap
+      while (c >= '0' && c <= '9')
+      {
+         width = width < UART_FMT_MAX / 10 ?
+                 width * 10 + (c - '0') : UART_FMT_MAX;
+         c = fmt_in_flash ? pgm_read_byte(++fmt) : *++fmt;
+      }
+      if (c == '.')
+      {
+         prec = 0;
+         c = fmt_in_flash ? pgm_read_byte(++fmt) : *++fmt;
+         while (c >= '0' && c <= '9')
+         {
+            prec = prec < UART_FMT_MAX / 10 ?
+                   prec * 10 + (c - '0') : UART_FMT_MAX;
+            c = fmt_in_flash ? pgm_read_byte(++fmt) : *++fmt;
+         }
+      }
+      if (c == 'l')
+      {
+         is_long = 1;
+         c = fmt_in_flash ? pgm_read_byte(++fmt) : *++fmt;
+      }
+
+      switch (c)
+      {
+      case '\0':
+         fmt--;						// let the loop see the end of the format
+         continue;
+
+      case 'c':
+         uart_fmt_pad(&f, ' ', left ? 0 : width - 1);
+         uart_fmt_put(&f, (char)va_arg(ap, int));
+         uart_fmt_pad(&f, ' ', left ? width - 1 : 0);
+         continue;
+
+      case 's':
+      case 'S':
+         str = va_arg(ap, const char *);
+         in_flash = (c == 'S');
+         for (len = 0; len < (prec < 0 ? UART_FMT_MAX : prec) && (in_flash ? pgm_read_byte(str + len) : str[len]); len++)
+            ;
+         uart_fmt_pad(&f, ' ', left ? 0 : width - len);
+         for (n = 0; n < len; n++)
+            uart_fmt_put(&f, in_flash ? pgm_read_byte(str + n) : str[n]);
+         uart_fmt_pad(&f, ' ', left ? width - len : 0);
+         continue;
+
+      case 'd':
+      case 'i':
+      case 'u':
+      case 'x':
+      case 'X':
+         base = (c == 'x' || c == 'X') ? 16 : 10;
+         neg = 0;
+         if (prec > (int16_t)sizeof(digits) - 1)
+            prec = sizeof(digits) - 1;	// prec + 1 digits have to fit
+         // prec becomes the minimum number of digits: in decimal, the ones
+         // after the point plus one before it
+         point = 0;
+         if (base == 10 && prec > 0)
+            point = prec++;
+         if (c == 'd' || c == 'i')
+         {
+            long v = is_long ? va_arg(ap, long) : va_arg(ap, int);
+
+            value = v;
+            if (v < 0)
+            {
+               neg = 1;
+               value = -value;		// unsigned, so LONG_MIN works too
+            }
+         }
+         else
+            value = is_long ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+
+         // digits come out backwards, least significant first
+         cp = digits;
+         do
+         {
+            uint8_t d = value % base;
+
+            *cp++ = d < 10 ? '0' + d : (c == 'x' ? 'a' : 'A') + d - 10;
+            value /= base;
+         } while (value || cp - digits < prec);
+
+         len = cp - digits + neg;
+         if (point)
+            len++;					// the decimal point
+         if (!left && !zero)
+            uart_fmt_pad(&f, ' ', width - len);
+         if (neg)
+            uart_fmt_put(&f, '-');
+         if (!left && zero)
+            uart_fmt_pad(&f, '0', width - len);
+         while (cp > digits)
+         {
+            if (point && cp - digits == point)
+               uart_fmt_put(&f, '.');
+            uart_fmt_put(&f, *--cp);
+         }
+         if (left)
+            uart_fmt_pad(&f, ' ', width - len);
+         continue;
+
+      default:						// %% and anything unknown
+         uart_fmt_put(&f, c);
+         continue;
+      }
+   }
+
+   uart_fmt_commit(&f);
+   return f.count;
+}
+
+int iuart_vprintf(uint8_t port, const char *fmt, va_list ap)
+{
+   return uart_vformat(port, fmt, 0, ap);
+}
+
+int iuart_vprintf_P(uint8_t port, const char *fmt, va_list ap)
+{
+   return uart_vformat(port, fmt, 1, ap);
+}
+
+int iuart_printf(uint8_t port, const char *fmt, ...)
+{
+   va_list ap;
+   int n;
+
+   va_start(ap, fmt);
+   n = uart_vformat(port, fmt, 0, ap);
+   va_end(ap);
+   return n;
+}
+
+int iuart_printf_P(uint8_t port, const char *fmt, ...)
+{
+   va_list ap;
+   int n;
+
+   va_start(ap, fmt);
+   n = uart_vformat(port, fmt, 1, ap);
+   va_end(ap);
+   return n;
+}
+
+// Sends bytes from flash, as text (with IUART_ONLCR applied) or as they are.
+// A buffer slot is taken if one is free or the port's policy waits for one,
+// otherwise the bytes are copied into the output buffer like any other.
+static int uart_write_P(uint8_t port, const uint8_t *buf, uint16_t len, uint8_t text)
+{
+   uart_fmt_t f;
+#if IUART_TX_BUFFERS
+   iuart_port_t *p = iuart_state(port);
+   iuart_iovec_t iov;
+
+   if (iuart_buffers_pending(port) < IUART_TX_BUFFERS ||
+       (p->tx_policy == UART_TX_BLOCK && (SREG & _BV(SREG_I))))
+   {
+      iov.base = buf;
+      iov.len = len;
+      iov.in_flash = 1;
+      return uart_writev(port, &iov, 1, text && UART_MODE(p, IUART_ONLCR));
+   }
+#endif
+
+   uart_fmt_begin(&f, port);
+   while (len--)
+   {
+      if (text)
+         uart_fmt_put(&f, pgm_read_byte(buf++));
+      else
+         uart_fmt_raw(&f, pgm_read_byte(buf++));
+   }
+   uart_fmt_commit(&f);
+   return f.failed ? EOF : 0;
+}
+
+int iuart_puts_P(uint8_t port, const char *s)
+{
+   return uart_write_P(port, (const uint8_t *)s, strlen_P(s), 1);
+}
+
+int iuart_write_P(uint8_t port, const uint8_t *buf, uint16_t len)
+{
+   return uart_write_P(port, buf, len, 0);
+}
+
+#if IUART_FRAMES || IUART_LOG
+// SLIP encodes one byte, escaping END and ESC.
+static void uart_slip_byte(uart_fmt_t *f, uint8_t c)
+{
+   if (c == IUART_SLIP_END || c == IUART_SLIP_ESC)
+   {
+      uart_fmt_raw(f, IUART_SLIP_ESC);
+      c = c == IUART_SLIP_END ? IUART_SLIP_ESC_END : IUART_SLIP_ESC_ESC;
+   }
+   uart_fmt_raw(f, c);
+}
+#endif
+
+#if IUART_LOG
+// Adds one byte to a log record, or with no port only counts the bytes it
+// takes once encoded.
+static void uart_log_byte(uart_fmt_t *f, uint8_t c)
+{
+   if (f->p)
+      uart_slip_byte(f, c);
+   else
+      f->count += c == IUART_SLIP_END || c == IUART_SLIP_ESC ? 2 : 1;
+}
+
+// Adds the bytes of one argument to a log record.
+static void uart_log_arg(uart_fmt_t *f, const void *arg, uint8_t n)
+{
+   const uint8_t *b = arg;
+
+   while (n--)
+      uart_log_byte(f, *b++);
+}
+
+// Adds a string argument, from RAM or flash, with its terminating NUL.
+static void uart_log_str(uart_fmt_t *f, const char *s, uint8_t flash)
+{
+   char c;
+
+   if (!s)
+      s = flash ? PSTR("(null)") : "(null)";
+   do
+   {
+      c = flash ? pgm_read_byte(s) : *s;
+      s++;
+      uart_log_byte(f, c);
+   }
+   while (c != '\0');
+}
+
+// Adds the body of a log record: the id of fmt and the arguments it takes
+// from ap. The format is only scanned for its conversions; all the
+// formatting is left to the host.
+static void uart_log_record(uart_fmt_t *f, const char *fmt, va_list ap)
+{
+   uint16_t id = (uint16_t)(uintptr_t)fmt;
+   int16_t i16;
+   int32_t i32;
+   float fl;
+   char c;
+   uint8_t l;
+
+   uart_log_arg(f, &id, sizeof id);
+
+   while ((c = pgm_read_byte(fmt++)) != '\0')
+   {
+      if (c != '%')
+         continue;
+
+      // flags, width and precision only matter to the host, but a * width
+      // is an argument of its own
+      l = 0;
+      for (;;)
+      {
+         c = pgm_read_byte(fmt++);
+         if (c == '*')
+         {
+            i16 = va_arg(ap, int);
+            uart_log_arg(f, &i16, sizeof i16);
+         }
+         else if (c == 'l')
+            l = 1;
+         else if (!isdigit((unsigned char)c) && c != '-' && c != '+' && c != ' ' &&
+                  c != '#' && c != '.' && c != 'h')
+            break;
+      }
+
+      switch (c)
+      {
+      case '\0':
+         fmt--;								// the format ended with a lone %
+         break;
+      case 's':
+      case 'S':
+         uart_log_str(f, va_arg(ap, const char *), c == 'S');
+         break;
+      case 'c':
+         c = va_arg(ap, int);
+         uart_log_arg(f, &c, 1);
+         break;
+      case 'e':
+      case 'E':
+      case 'f':
+      case 'F':
+      case 'g':
+      case 'G':
+         fl = va_arg(ap, double);
+         uart_log_arg(f, &fl, sizeof fl);
+         break;
+      case 'p':
+         i16 = (uintptr_t)va_arg(ap, void *);
+         uart_log_arg(f, &i16, sizeof i16);
+         break;
+      case 'd':
+      case 'i':
+      case 'u':
+      case 'x':
+      case 'X':
+      case 'o':
+         if (l)
+         {
+            i32 = va_arg(ap, long);
+            uart_log_arg(f, &i32, sizeof i32);
+         }
+         else
+         {
+            i16 = va_arg(ap, int);
+            uart_log_arg(f, &i16, sizeof i16);
+         }
+         break;
+      default:								// %% and anything unknown take no argument
+         break;
+      }
+   }
+}
+
+/*
+ * Queues a log record, SLIP framed like iuart_frame_send() output and
+ * written straight into the output buffer the same way.  With
+ * UART_TX_FAIL a record is queued either whole or not at all: its
+ * encoded length is worked out first, from a copy of ap, so a full
+ * buffer never puts part of a record on the line.  The other policies
+ * apply byte by byte once the buffer fills up.
+ */
+void iuart_vlog(uint8_t port, const char *fmt, va_list ap)
+{
+   uart_fmt_t f, size;
+   va_list aq;
+
+   uart_fmt_begin(&f, port);
+   if (f.p->tx_policy == UART_TX_FAIL)
+   {
+      size.p = NULL;							// count only
+      size.count = 2;							// the ENDs
+      va_copy(aq, ap);
+      uart_log_record(&size, fmt, aq);
+      va_end(aq);
+      if ((size_t)size.count > uart_tx_space(f.p))
+      {
+         f.p->counters.tx_failed += size.count;
+         return;
+      }
+   }
+
+   uart_fmt_raw(&f, IUART_SLIP_END);
+   uart_log_record(&f, fmt, ap);
+   uart_fmt_raw(&f, IUART_SLIP_END);
+   uart_fmt_commit(&f);
+}
+
+void iuart_log(uint8_t port, const char *fmt, ...)
+{
+   va_list ap;
+
+   va_start(ap, fmt);
+   iuart_vlog(port, fmt, ap);
+   va_end(ap);
+}
+#endif
+
+#if IUART_FLOW_CONTROL || IUART_XONXOFF
+// Number of bytes taking up room in the receive buffer; in frame mode the
+// frame still being received counts too.
+static inline uart_rx_index_t uart_rx_used(iuart_port_t *p)
+{
+   uart_rx_index_t head = p->rx_next_free;
+
+#if IUART_FRAMES
+   if (p->frame_mode)
+      head = p->frame_head;
+#endif
+   return (head - p->rx_next_to_read) & UART_RX_BUFFER_MASK;
+}
+
+#endif
+
+#if IUART_XONXOFF
+// Queues an XON or XOFF ahead of everything in the output buffer, to be sent
+// even while output is stopped. Called with interrupts disabled; while the
+// output buffer is locked, uart_tx_unlock() enables the interrupt instead.
+static inline void uart_tx_control(iuart_port_t *p, iuart_regs_t *r, uint8_t c)
+{
+   p->tx_control = c;
+   uart_tx_start(p);
+   if (!p->tx_locked)
+      r->ucsrb |= _BV(UDRIE0);
+}
+
+#endif
+
+#if IUART_FLOW_CONTROL || IUART_XONXOFF
+// Lets the peer send again once the reader has brought the receive buffer
+// down to the low watermark, by lowering RTS or sending an XON. The RX
+// interrupt stops the peer, so this is done atomically.
+static void uart_rx_consumed(iuart_port_t *p, iuart_regs_t *r)
+{
+#if IUART_FLOW_CONTROL
+   if (UART_FLOW(p) && UART_RTS_IS_OFF())
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+         if (uart_rx_used(p) <= IUART_RTS_LOW)
+            IUART_RTS_PORT &= ~_BV(IUART_RTS_BIT);
+      }
+#endif
+#if IUART_XONXOFF
+   if (p->rx_stopped)
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+         if (uart_rx_used(p) <= IUART_XON_LOW)
+         {
+            p->rx_stopped = 0;
+            uart_tx_control(p, r, IUART_XON);
+         }
+      }
+#endif
+}
+#else
+#define uart_rx_consumed(p, r)
+#endif
+
+#if IUART_MULTIDROP
+// UCSRnA holds flags that are cleared by writing them as 1 (TXC0), so it is
+// never read-modify-written: only the U2X0 setting is carried over.
+#define UART_MPCM_ON(r)				((r)->ucsra = ((r)->ucsra & _BV(U2X0)) | _BV(MPCM0))
+#define UART_MPCM_OFF(r)			((r)->ucsra = (r)->ucsra & _BV(U2X0))
+
+/*
+ * Puts the port on a 9-bit multidrop bus, or back to 8-bit frames with
+ * IUART_MULTIDROP_OFF.  The 9th bit marks address frames, which name
+ * the node the following data frames are meant for.
+ *
+ * The master receives everything and sends address frames with
+ * iuart_send_address().  A node sets MPCM0, so the USART itself drops
+ * data frames without an interrupt.  When an address frame carries its
+ * address (or IUART_MPCM_BROADCAST), the RX interrupt clears MPCM0 and
+ * the data that follows is received as usual.  Filtering is armed again
+ * by the next address frame for another node, by iuart_mpcm_rearm(),
+ * and in frame mode at the end of each frame.  Address frames are
+ * never put in the receive buffer.
+ */
+void iuart_set_multidrop(uint8_t port, uint8_t mode, uint8_t address)
+{
+   iuart_port_t *p = iuart_state(port);
+   iuart_regs_t *r = iuart_regs(port);
+
+   ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+   {
+      p->multidrop = mode;
+      p->address = address;
+      if (mode == IUART_MULTIDROP_OFF)
+         r->ucsrb &= ~_BV(UCSZ02);
+      else
+      {
+         r->ucsrc |= IUART_DATA8;				// 9-bit frames: UCSZ01 and UCSZ00 set as well
+         r->ucsrb |= _BV(UCSZ02);
+      }
+      if (mode == IUART_MULTIDROP_NODE)
+         UART_MPCM_ON(r);
+      else
+         UART_MPCM_OFF(r);
+   }
+   uart_rtu_timing(port);						// the 9th bit makes characters longer
+}
+
+void iuart_mpcm_rearm(uint8_t port)
+{
+   ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+   {
+      if (iuart_state(port)->multidrop == IUART_MULTIDROP_NODE)
+         UART_MPCM_ON(iuart_regs(port));
+   }
+}
+
+/*
+ * Sends an address frame, with the 9th bit set, after everything queued
+ * so far has gone out; queue the data for the node right after it.  The
+ * byte is loaded into UDRn directly while the transmitter is idle, so
+ * TXB80 only needs to stay set until it has moved on to the shift
+ * register.  Returns 0, or EOF if interrupts are disabled and there is
+ * still output pending.
+ */
+int iuart_send_address(uint8_t port, uint8_t address)
+{
+   iuart_port_t *p = iuart_state(port);
+   iuart_regs_t *r = iuart_regs(port);
+
+   if (iuart_flush(port) == EOF)
+      return EOF;
+
+   ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+   {
+      uart_tx_start(p);
+      r->ucsrb |= _BV(TXB80);
+      r->udr = address;
+      while (!(r->ucsra & _BV(UDRE0)))
+         ;
+      r->ucsrb &= ~_BV(TXB80);
+      p->counters.tx_bytes++;
+   }
+   return 0;
+}
+
+#endif
+
+#if IUART_XONXOFF
+/*
+ * Switches XON/XOFF flow control on or off.  While it is on, received
+ * XON and XOFF characters are taken out of the input and start and stop
+ * output; the driver in turn sends XOFF and XON as the receive buffer
+ * fills and drains.  Both are sent ahead of whatever is queued, even
+ * while output is stopped.  The RX interrupt stays enabled while the
+ * output buffer is updated; one that comes in then only notes the change,
+ * and output restarts once the update is done.
+ *
+ * Turning it off resumes stopped output, and sends an XON if the peer
+ * was told to stop.  Binary data has to avoid the two characters.
+ */
+void iuart_set_xonxoff(uint8_t port, uint8_t on)
+{
+   iuart_port_t *p = iuart_state(port);
+   iuart_regs_t *r = iuart_regs(port);
+
+   ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+   {
+      p->xonxoff = on;
+      if (!on)
+      {
+         if (p->rx_stopped)
+            uart_tx_control(p, r, IUART_XON);
+         p->rx_stopped = 0;
+         p->tx_stopped = 0;
+         if (UART_TX_PENDING(p))
+            r->ucsrb |= _BV(UDRIE0);
+      }
+   }
+}
+
+#endif
+
+#if IUART_FRAMES
+/*
+ * Switches frame mode on or off.  With IUART_FRAME_SLIP the RX interrupt
+ * decodes SLIP (RFC 1055): frames are delimited by IUART_SLIP_END, and
+ * IUART_SLIP_ESC followed by IUART_SLIP_ESC_END or IUART_SLIP_ESC_ESC
+ * stands for an END or ESC byte in the data.  Decoded bytes go straight
+ * into the receive buffer, and only a complete frame is published, so
+ * the application has nothing to do until iuart_frame_len() says a
+ * frame is there.  Empty frames, such as the END a sender puts in front
+ * of each frame to flush line noise, are skipped.
+ *
+ * With IUART_FRAME_RTU, only available on IUART_RTU_PORT, the bytes are
+ * taken as they are and a frame ends when the line has been quiet for
+ * 3.5 characters (see IUART_RTU).  Every byte restarts the silence
+ * timer, and its compare interrupt publishes the frame, so frames show
+ * up just the same.  iuart_frame_send() then sends the data as it is;
+ * leaving the silence in front of a frame is up to the caller, which
+ * a slave answering a request gets for free.  The request is ignored
+ * on other ports.
+ *
+ * With IUART_CRC, the last IUART_CRC_BYTES of each frame are its CRC.
+ * It is checked as the bytes come in, and stripped: the frame length
+ * and the data handed out don't include it.
+ *
+ * A frame with a receive error, a bad escape or a CRC that doesn't
+ * check, or that doesn't fit in the receive buffer or the frame queue,
+ * is dropped as a whole, and counted in rx_bad_frames.
+ *
+ * Anything waiting in the receive buffer is discarded when the mode
+ * changes.  Use the iuart_frame_*() routines instead of iuart_getc()
+ * and the line input ones while frame mode is on.
+ */
+void iuart_set_frame_mode(uint8_t port, uint8_t mode)
+{
+   iuart_port_t *p = iuart_state(port);
+
+   if (mode == IUART_FRAME_RTU && !UART_RTU(p))
+      return;									// only that port has the silence timer
+
+   ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+   {
+#if IUART_RTU
+      if (UART_RTU(p))
+         TIMSK1 &= ~_BV(OCIE1B);				// forget the frame being timed
+#endif
+      p->frame_mode = mode;
+      p->frame_esc = 0;
+      p->frame_bad = 0;
+      p->rx_next_to_read = p->rx_next_free;
+      p->frame_head = p->rx_next_free;
+      p->frame_next_to_read = 0;
+      p->frame_next_free = 0;
+#if IUART_CRC
+      p->frame_crc = IUART_CRC_INIT;
+#endif
+   }
+   uart_rx_consumed(p, iuart_regs(port));
+}
+
+int16_t iuart_frame_len(uint8_t port)
+{
+   iuart_port_t *p = iuart_state(port);
+   uint8_t tail = p->frame_next_to_read;
+
+   if (tail == p->frame_next_free)
+      return -1;
+
+   IUART_BARRIER();
+   return p->frame_len[tail & (IUART_FRAME_QUEUE - 1)];
+}
+
+// Completed frames sit back to back in the receive buffer from
+// rx_next_to_read on, so the copy takes at most two chunks, one up to the
+// end of the wrap-around buffer and one from its beginning. Like iuart_getc()
+// this only moves the read side, so no interrupt masking is needed.
+int16_t iuart_frame_read(uint8_t port, uint8_t *buf, size_t size)
+{
+   iuart_port_t *p = iuart_state(port);
+   int16_t len = iuart_frame_len(port);
+   uart_rx_index_t tail = p->rx_next_to_read;
+   size_t n, chunk;
+
+   if (len < 0)
+      return -1;
+
+   n = size < (size_t)len ? size : (size_t)len;
+   if (buf && n)
+   {
+      chunk = UART_RX_BUFFER_SIZE - tail;
+      if (chunk > n)
+         chunk = n;
+      memcpy(buf, &p->rx_buffer[tail], chunk);
+      memcpy(buf + chunk, p->rx_buffer, n - chunk);
+   }
+
+#if IUART_CRC
+   tail += IUART_CRC_BYTES;					// the CRC goes with the frame
+#endif
+   IUART_BARRIER();
+   UART_RX_INDEX_ATOMIC()
+   {
+      p->rx_next_to_read = (tail + len) & UART_RX_BUFFER_MASK;
+   }
+   p->frame_next_to_read++;
+   uart_rx_consumed(p, iuart_regs(port));
+
+   return len;
+}
+
+// Silence framed ports send frames as they are, the rest SLIP encode them
+#define UART_FRAME_SLIP(p)			(!UART_RTU(p) || (p)->frame_mode != IUART_FRAME_RTU)
+
+// Encodes one byte of frame data.
+static void uart_frame_byte(uart_fmt_t *f, uint8_t c)
+{
+   if (UART_FRAME_SLIP(f->p))
+      uart_slip_byte(f, c);
+   else
+      uart_fmt_raw(f, c);
+}
+
+/*
+ * Queues a block as one SLIP frame: an END, the data with END and ESC
+ * bytes escaped, the CRC with IUART_CRC, and a closing END.  In
+ * IUART_FRAME_RTU mode it is just the data and the CRC.  Encoding, and
+ * the CRC, are done in one pass straight into the output buffer like
+ * iuart_printf(), with one index update at the end.
+ *
+ * With UART_TX_FAIL a frame is queued either whole or not at all, so a
+ * full buffer never puts half a frame on the line.  The other policies
+ * apply byte by byte once the buffer fills up.
+ *
+ * Returns 0, or EOF if the frame was rejected.
+ */
+int iuart_frame_send(uint8_t port, const uint8_t *buf, size_t len)
+{
+   uart_fmt_t f;
+   size_t i, need = len + 2;
+   uint8_t c;
+#if IUART_CRC
+   iuart_crc_t crc = IUART_CRC_INIT;
+
+   need += 2 * IUART_CRC_BYTES;				// room for the CRC, should it need escaping
+#endif
+
+   uart_fmt_begin(&f, port);
+
+   if (UART_FRAME_SLIP(f.p))
+   {
+      for (i = 0; i < len; i++)
+         if (buf[i] == IUART_SLIP_END || buf[i] == IUART_SLIP_ESC)
+            need++;
+   }
+   else
+      need -= 2;								// no ENDs
+   if (f.p->tx_policy == UART_TX_FAIL && need > uart_tx_space(f.p))
+   {
+      f.p->counters.tx_failed += need;
+      return EOF;
+   }
+
+   if (UART_FRAME_SLIP(f.p))
+      uart_fmt_raw(&f, IUART_SLIP_END);
+   for (i = 0; i < len; i++)
+   {
+      c = buf[i];
+#if IUART_CRC
+      crc = uart_crc_update(crc, c);
+#endif
+      uart_frame_byte(&f, c);
+   }
+#if IUART_CRC
+   uart_frame_byte(&f, crc);
+#if IUART_CRC == 16
+   uart_frame_byte(&f, crc >> 8);
+#endif
+#endif
+   if (UART_FRAME_SLIP(f.p))
+      uart_fmt_raw(&f, IUART_SLIP_END);
+   uart_fmt_commit(&f);
 
+   return 0;
 }
 
-// If transmit is in progress, adds a character to the UART output buffer.
-// If transmit is not in progress, kicks off a transmit.
-//
-// The send buffer is a wrap-around buffer.
-//
-// If the buffer is full, then this routine returns EOF.
-// A successful completion returns 0.
-//
-// This routine disables the UART Tx interrupt temporarily, because
-// things would get funky if the interrupt signal routine were called during
-// execution of this routione.
+#endif
+
+// Fetches the oldest byte from the receive buffer without blocking.
 //
-// If the buffer was empty to start with, then this routine "primes the pump"
-// sending the character directly to the UART.
+// Returns the byte as an unsigned char, or EOF if nothing was received yet.
+// Bytes are returned raw: no echo, no line editing, no CR/NL mapping.
 //
-// This routine also adds carriage returns to newlines.
+// Only this routine moves rx_next_to_read, and the RX interrupt
+// only moves rx_next_free, so no interrupt masking is needed here,
+// beyond the index accesses of a buffer over 256 bytes.
 //
-int UART0_Putchar(char c, FILE *stream)
+int iuart_getc(uint8_t port)
 {
-   register int ReturnStatus = 0; 			// return 0 for success
-   register int UartBufferNextFree_last; 	// space to save last UartBufferNextFree
-
-   // if character is a "newline" then add a "carriage return" before it.
-   if (c == '\n')
-      UART0_Putchar('\r', stream);
-
+   iuart_port_t *p = iuart_state(port);
+   uint8_t c;
+   uart_rx_index_t tail = p->rx_next_to_read;
+   uart_rx_index_t head;
 
-   // if no send is already in progress, then "prime the pump" by sending directly to UART
-   if (UartSendingInProgress == 0)
+   UART_RX_INDEX_ATOMIC()
    {
-      // set "sending in progress" flag
-      UartSendingInProgress = 1;
-      // send the first byte!
-      UDR0 = c;
+      head = p->rx_next_free;
    }
-   else
+   if (tail == head) // if buffer is empty -
+      return EOF;
+
+   IUART_BARRIER();
+   c = p->rx_buffer[tail];
+   UART_RX_INDEX_ATOMIC()
    {
-      // disable the Tx Complete interrupt
-      UCSR0B &= ~_BV(TXCIE0);
+      p->rx_next_to_read = (tail + 1) & UART_RX_BUFFER_MASK;
+   }
+   uart_rx_consumed(p, iuart_regs(port));
 
-      UartBuffer[UartBufferNextFree] = c;
+   return c;
+}
 
-      // increment the next free byte index, while saving last value
-      UartBufferNextFree_last = UartBufferNextFree++;
+int UART0_Getchar(void)
+{
+   return iuart_getc(0);
+}
 
-       // check for wrap-around
-      if (UartBufferNextFree == UART_BUFFER_SIZE) // if we reached the end of the buffer -
-           UartBufferNextFree = 0; // start back at the beginning
+// Returns the number of bytes waiting in the receive buffer.
+int iuart_rx_available(uint8_t port)
+{
+   iuart_port_t *p = iuart_state(port);
+   uart_rx_index_t head;
 
-      if (UartBufferNextFree == UartBufferNextByteToSend) // if buffer is full -
-      {
-         // bump back the index so transmit routine doesn't think buffer's empty
-         UartBufferNextFree = UartBufferNextFree_last;
-         // return with error code   
-         ReturnStatus = EOF;
-      }
-      
-      // enable the Tx Complete interrupt
-      UCSR0B |= _BV(TXCIE0);
+   UART_RX_INDEX_ATOMIC()
+   {
+      head = p->rx_next_free;
    }
+   return (uart_rx_index_t)(head - p->rx_next_to_read) & UART_RX_BUFFER_MASK;
+}
 
+int UART0_RxAvailable(void)
+{
+   return iuart_rx_available(0);
+}
 
-   // return with status code
-   return ReturnStatus;
-} 
+// Echo the line editor still owes the terminal, in line_echo
+#define UART_LINE_REPRINT	0x01		// a ^r: a carriage return, then the whole line
+#define UART_LINE_NEWLINE	0x02		// the end of the completed line
+
+// Whether the terminal shows exactly the line being edited, with no echo owed
+#define UART_LINE_SYNCED(p)	(!(p)->line_echo && (p)->line_keep == (p)->line_shown && \
+							 (p)->line_shown == (p)->line_len)
+
+// Most bytes uart_line_redraw() queues with one masking of the RX interrupt
+#define UART_LINE_STEP		16
+
+// Queues echo bytes. They are no part of what iuart_write() is summing up,
+// so the running CRC is left as it was.
+static void uart_line_write(iuart_port_t *p, iuart_regs_t *r, const char *s, uint8_t n)
+{
+#if IUART_CRC
+  iuart_crc_t crc = p->tx_crc;
+#endif
+
+  uart_write_block(p, r, (const uint8_t *)s, n);
+#if IUART_CRC
+  p->tx_crc = crc;
+#endif
+}
+
+// Stores the echo of a newline, with a carriage return before it with
+// IUART_ONLCR, and returns its length.
+static uint8_t uart_line_newline(iuart_port_t *p, char *e)
+{
+  uint8_t n = 0;
+
+  if (UART_MODE(p, IUART_ONLCR))
+    e[n++] = '\r';
+  e[n++] = '\n';
+  return n;
+}
+
+// Echoes the n bytes of one edit right away, in a single uart_write_block(),
+// if the terminal was in step with the line before it (synced) and they all
+// fit. Returns 0 if they were left to uart_line_redraw(), 1 otherwise, which
+// includes a port without IUART_ECHO.
+static uint8_t uart_line_echo(iuart_port_t *p, iuart_regs_t *r, const char *e, uint8_t n, uint8_t synced)
+{
+  if (!UART_MODE(p, IUART_ECHO))
+    return 1;
+  if (!synced || uart_tx_space(p) < n)
+    return 0;
+  uart_line_write(p, r, e, n);
+  return 1;
+}
 
 /*
- * Receive a character from the UART Rx.
+ * Brings the terminal in step with the line being edited: rubs out what
+ * it shows past the part that still matches, carries out a ^r and echoes
+ * the rest of the line, then the end of a completed line.  That is the
+ * echo uart_line_input() can't do with a few bytes, or couldn't queue
+ * for lack of room.
+ *
+ * It goes UART_LINE_STEP bytes at a time, each step with one
+ * uart_write_block() and, in line mode, the RX interrupt masked so that
+ * it doesn't edit the line meanwhile.  With UART_TX_BLOCK it waits for
+ * room; otherwise whatever doesn't fit is left for the next call.
+ */
+static void uart_line_redraw(iuart_port_t *p, iuart_regs_t *r)
+{
+  char e[UART_LINE_STEP];
+  uint8_t n, space, len, synced;
+#if IUART_LINE_MODE
+  uint8_t hold = p->line_mode ? _BV(RXCIE0) : 0;
+#endif
+
+  for (;;)
+    {
+#if IUART_LINE_MODE
+      UART_UCSRB_ATOMIC()
+	{
+	  r->ucsrb &= ~hold;
+	}
+#endif
+      n = 0;
+      if (!UART_MODE(p, IUART_ECHO))
+	{
+	  p->line_shown = p->line_keep = p->line_len;
+	  p->line_echo = 0;
+	}
+      space = uart_tx_space(p) < sizeof e ? uart_tx_space(p) : sizeof e;
+      len = p->line_echo & UART_LINE_NEWLINE ? p->line_done_len : p->line_len;
+
+      while (p->line_shown > p->line_keep && n + 3 <= space)
+	{
+	  e[n++] = '\b';
+	  e[n++] = ' ';
+	  e[n++] = '\b';
+	  p->line_shown--;
+	}
+      if (p->line_shown == p->line_keep)
+	{
+	  if ((p->line_echo & UART_LINE_REPRINT) && n < space)
+	    {
+	      e[n++] = '\r';
+	      p->line_shown = p->line_keep = 0;
+	      p->line_echo &= ~UART_LINE_REPRINT;
+	    }
+	  if (!(p->line_echo & UART_LINE_REPRINT))
+	    {
+	      while (p->line_shown < len && n < space)
+		e[n++] = p->line[p->line_shown++];
+	      p->line_keep = p->line_shown;
+	      if ((p->line_echo & UART_LINE_NEWLINE) && p->line_shown == len && n + 2 <= space)
+		{
+		  n += uart_line_newline(p, e + n);
+		  p->line_shown = p->line_keep = 0;
+		  p->line_echo &= ~UART_LINE_NEWLINE;
+		}
+	    }
+	}
+      if (n)
+	uart_line_write(p, r, e, n);
+      synced = UART_LINE_SYNCED(p);
+#if IUART_LINE_MODE
+      UART_UCSRB_ATOMIC()
+	{
+	  r->ucsrb |= hold;
+	}
+#endif
+
+      if (synced)
+	return;
+      if (n == 0 && (p->tx_policy != UART_TX_BLOCK || uart_tx_wait(p) == EOF))
+	return;
+    }
+}
+
+/*
+ * Feeds one received character into the line editor of a port.
+ *
+ * This is a simple line-editor that allows to delete and re-edit the
+ * characters entered, until either CR or NL is entered. Printable
+ * characters entered will be echoed into the port's output buffer.
  *
- * This features a simple line-editor that allows to delete and
- * re-edit the characters entered, until either CR or NL is entered.
- * Printable characters entered will be echoed using UART0_Putchar().
+ * The port's mode decides the details: CR only ends a line with
+ * IUART_ICRNL (it is ignored otherwise), and nothing at all is echoed
+ * without IUART_ECHO.
  *
  * Editing characters:
  *
@@ -115,164 +2631,802 @@ int UART0_Putchar(char c, FILE *stream)
  * . ^w deletes the previous word
  * . ^r sends a CR, and then reprints the buffer
  * . \t will be replaced by a single space
+ * . ^c abandons the line
  *
  * All other control characters will be ignored.
  *
- * The internal line buffer is RX_BUFSIZE (80) characters long, which
- * includes the terminating \n (but no terminating \0).  If the buffer
- * is full (i. e., at RX_BUFSIZE-1 characters in order to keep space for
- * the trailing \n), any further input attempts will send a \a to
- * UART0_Putchar() (BEL character), although line editing is still
- * allowed.
+ * The line buffer is RX_BUFSIZE (80) characters long, which includes
+ * the terminating \n, followed by a \0 once complete.  If the buffer is full
+ * (i. e., at RX_BUFSIZE-1 characters in order to keep space for the
+ * trailing \n), any further input attempts will echo a \a (BEL
+ * character), although line editing is still allowed.  Every port has
+ * its own line buffer.
+ *
+ * It works one character at a time, so it can run either from
+ * uart_getchar() or, in line mode, straight from the RX interrupt.  It
+ * does a bounded amount of work either way: an edit echoes at most
+ * three bytes, with one uart_write_block(), and only when the terminal
+ * is in step with the line and they fit.  Everything else, the rubouts
+ * of ^u and ^w and the reprint of ^r included, is left to
+ * uart_line_redraw(), which the callers run outside the interrupt.
+ *
+ * Returns 1 when the line is complete, -1 when it was abandoned with
+ * ^c (the line is emptied) and 0 otherwise.
+ */
+static int8_t uart_line_input(iuart_port_t *p, iuart_regs_t *r, uint8_t c)
+{
+  char *b = p->line;
+  char e[3];
+  uint8_t synced;
+
+  // the end of the previous line never made it out, and its text is gone
+  if (p->line_echo & UART_LINE_NEWLINE)
+    {
+      p->line_echo = 0;
+      p->line_shown = p->line_keep = 0;
+    }
+  synced = UART_LINE_SYNCED(p);
+
+  /* behaviour similar to Unix stty ICRNL */
+  if (c == '\r' && UART_MODE(p, IUART_ICRNL))
+    c = '\n';
+  if (c == '\n')
+    {
+      b[p->line_len] = c;
+      b[p->line_len + 1] = '\0';
+      p->line_done_len = p->line_len;
+      p->line_len = 0;
+      if (uart_line_echo(p, r, e, uart_line_newline(p, e), synced))
+	p->line_shown = p->line_keep = 0;
+      else
+	p->line_echo |= UART_LINE_NEWLINE;
+      return 1;
+    }
+  else if (c == '\t')
+    c = ' ';
+
+  if ((c >= (uint8_t)' ' && c <= (uint8_t)'\x7e') ||
+      c >= (uint8_t)'\xa0')
+    {
+      if (p->line_len == RX_BUFSIZE - 1)
+	uart_line_echo(p, r, "\a", 1, synced);	// dropped if it can't go out now
+      else
+	{
+	  b[p->line_len++] = c;
+	  e[0] = c;
+	  if (uart_line_echo(p, r, e, 1, synced))
+	    p->line_shown = p->line_keep = p->line_len;
+	}
+      return 0;
+    }
+
+  switch (c)
+    {
+    case 'c' & 0x1f:
+      // the abandoned line stays on the terminal
+      p->line_len = 0;
+      p->line_shown = p->line_keep = 0;
+      p->line_echo = 0;
+      return -1;
+
+    case '\b':
+    case '\x7f':
+      if (p->line_len > 0)
+	{
+	  p->line_len--;
+	  if (uart_line_echo(p, r, "\b \b", 3, synced))
+	    p->line_shown = p->line_keep = p->line_len;
+	}
+      break;
+
+    case 'r' & 0x1f:
+      p->line_echo |= UART_LINE_REPRINT;
+      break;
+
+    case 'u' & 0x1f:
+      p->line_len = 0;
+      break;
+
+    case 'w' & 0x1f:
+      while (p->line_len > 0 && b[p->line_len - 1] != ' ')
+	p->line_len--;
+      break;
+    }
+
+  if (p->line_keep > p->line_len)
+    p->line_keep = p->line_len;
+  if (!UART_MODE(p, IUART_ECHO))
+    {
+      p->line_shown = p->line_keep = p->line_len;
+      p->line_echo = 0;
+    }
+  return 0;
+}
+
+#if IUART_LINE_MODE
+// Switches line mode on or off. In line mode the RX interrupt runs every
+// received character through the line editor and echoes it right away, but
+// for rubouts of more than one character and reprints, which wait for the
+// next iuart_getline(), iuart_line_release() or getchar call; once a line is
+// complete, iuart_getline() returns it and further input waits in the
+// receive buffer until it is released with iuart_line_release().
+void iuart_set_line_mode(uint8_t port, uint8_t on)
+{
+  iuart_port_t *p = iuart_state(port);
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    p->line_mode = on;
+    p->line_ready = 0;
+    p->line_len = 0;
+    p->line_shown = p->line_keep = 0;
+    p->line_echo = 0;
+    p->line_next = 0;
+  }
+}
+
+#endif
+
+// Returns 1 once a completed line is being held, see iuart_getline().
+uint8_t iuart_line_ready(uint8_t port)
+{
+  return iuart_state(port)->line_ready;
+}
+
+/*
+ * Returns the next completed line in place, in the port's line buffer, or
+ * NULL if no line is complete yet.  Never blocks.
+ *
+ * The line is terminated by "\n\0"; *len (if len is not NULL) is set to
+ * the number of characters before the \n.  The caller may modify the line,
+ * e.g. tokenise it with strtok(), and owns it until iuart_line_release().
+ * Calling this again before that returns the same line.
+ *
+ * In line mode the line was already assembled by the RX interrupt.
+ * Otherwise the characters waiting in the receive buffer are run through
+ * the line editor here.  Either way the echo the editor left owing is
+ * queued here, see uart_line_redraw().  Receive errors are left latched for
+ * uart_getchar() and the counters; the byte in error never makes it into
+ * the line.
+ *
+ * Do not mix with uart_getchar() on the same port.
+ */
+char *iuart_getline(uint8_t port, uint8_t *len)
+{
+  iuart_port_t *p = iuart_state(port);
+  int c;
+
+#if IUART_LINE_MODE
+  if (!p->line_mode)
+#endif
+    while (!p->line_ready && (c = iuart_getc(port)) != EOF)
+      if (uart_line_input(p, iuart_regs(port), c) > 0)
+	p->line_ready = 1;
+  uart_line_redraw(p, iuart_regs(port));
+
+  if (!p->line_ready)
+    return 0;
+
+  if (len)
+    *len = p->line_done_len;
+  return p->line;
+}
+
+/*
+ * Hands the line buffer back for the next line, once the end of the line
+ * has been echoed.  In line mode, the characters that arrived while the
+ * line was held are edited now, with the RX interrupt masked so it
+ * doesn't feed the editor at the same time; this may complete the next
+ * line immediately.
+ */
+void iuart_line_release(uint8_t port)
+{
+  iuart_port_t *p = iuart_state(port);
+  iuart_regs_t *r = iuart_regs(port);
+#if IUART_LINE_MODE
+  int c;
+#endif
+
+  uart_line_redraw(p, r);
+#if IUART_LINE_MODE
+  if (p->line_mode)
+    {
+      UART_UCSRB_ATOMIC()
+	{
+	  r->ucsrb &= ~_BV(RXCIE0);
+	}
+      p->line_ready = 0;
+      p->line_next = 0;
+      while (!p->line_ready && (c = iuart_getc(port)) != EOF)
+	if (uart_line_input(p, r, c) > 0)
+	  p->line_ready = 1;
+      UART_UCSRB_ATOMIC()
+	{
+	  r->ucsrb |= _BV(RXCIE0);
+	}
+      uart_line_redraw(p, r);
+      return;
+    }
+#endif
+  p->line_ready = 0;
+  p->line_next = 0;
+}
+
+// Waits in idle sleep for the next byte in the receive buffer. Returns it, or
+// the latched receive error: _FDEV_EOF for a framing error, _FDEV_ERR for the
+// others, and also when interrupts are disabled and nothing is there.
+static int uart_wait_byte(iuart_port_t *p, uint8_t port)
+{
+  uint8_t status;
+  int c;
+
+  if (SREG & _BV(SREG_I))
+    IUART_SLEEP_UNTIL(p->rx_status != 0 || p->rx_next_to_read != p->rx_next_free);
+  if ((status = p->rx_status) != 0)
+    {
+      p->rx_status = 0;
+      if (status & _BV(FE0))
+	return _FDEV_EOF;
+      return _FDEV_ERR;
+    }
+  c = iuart_getc(port);
+  return c == EOF ? _FDEV_ERR : c;
+}
+
+/*
+ * Receive a character from the UART Rx.
+ *
+ * The line is assembled with the line editor above, reading characters
+ * from the interrupt-filled receive buffer, so bytes arriving while
+ * the application is busy elsewhere are not lost as long as
+ * UART_RX_BUFFER_SIZE is not exceeded.  In line mode the line is
+ * assembled by the RX interrupt instead and this routine just waits
+ * for it.  Waiting is done in idle sleep, woken by the RX interrupt.
  *
  * Input errors while talking to the UART will cause an immediate
  * return of -1 (error indication).  Notably, this will be caused by a
  * framing error (e. g. serial line "break" condition), by an input
- * overrun, and by a parity error (if parity was enabled and automatic
- * parity recognition is supported by hardware).
+ * overrun (either in the hardware or because the receive buffer was
+ * full), and by a parity error (if parity was enabled and automatic
+ * parity recognition is supported by hardware).  The errors are
+ * latched by the RX interrupt and reported once.  A ^c typed outside
+ * line mode also returns -1.
  *
- * Successive calls to uart_getchar() will be satisfied from the
- * internal buffer until that buffer is emptied again.
+ * Successive calls will be satisfied from the line buffer until that
+ * buffer is emptied again.
+ *
+ * Without IUART_ICANON (and always in a raw build) there is no line
+ * editing outside line mode: each call waits for the next byte and
+ * returns it as it is, or the error.
  */
-int uart_getchar(FILE *stream)
+int iuart_getline_char(uint8_t port)
 {
+  iuart_port_t *p = iuart_state(port);
   uint8_t c;
-  char *cp, *cp2;
-  static char b[RX_BUFSIZE];
-  static char *rxp;
+  int rc;
 
-  if (rxp == 0)
-    for (cp = b;;)
-      {
-	loop_until_bit_is_set(UCSR0A, RXC0);
-	if (UCSR0A & _BV(FE0))
-	  return _FDEV_EOF;
-	if (UCSR0A & _BV(DOR0))
-	  return _FDEV_ERR;
-	c = ReceivedByte;
-	/* behaviour similar to Unix stty ICRNL */
-	if (c == '\r')
-	  c = '\n';
-	if (c == '\n')
-	  {
-	    *cp = c;
-	    UART0_Putchar(c, stream);
-	    rxp = b;
-	    break;
-	  }
-	else if (c == '\t')
-	  c = ' ';
-
-	if ((c >= (uint8_t)' ' && c <= (uint8_t)'\x7e') ||
-	    c >= (uint8_t)'\xa0')
-	  {
-	    if (cp == b + RX_BUFSIZE - 1)
-	      UART0_Putchar('\a', stream);
-	    else
-	      {
-		*cp++ = c;
-		UART0_Putchar(c, stream);
-	      }
-	    continue;
-	  }
-
-	switch (c)
-	  {
-	  case 'c' & 0x1f:
-	    return -1;
+  if (!UART_MODE(p, IUART_ICANON)
+#if IUART_LINE_MODE
+      && !p->line_mode
+#endif
+      )
+    return uart_wait_byte(p, port);
 
-	  case '\b':
-	  case '\x7f':
-	    if (cp > b)
-	      {
-		UART0_Putchar('\b', stream);
-		UART0_Putchar(' ', stream);
-		UART0_Putchar('\b', stream);
-		cp--;
-	      }
-	    break;
-
-	  case 'r' & 0x1f:
-	    UART0_Putchar('\r', stream);
-	    for (cp2 = b; cp2 < cp; cp2++)
-	      UART0_Putchar(*cp2, stream);
-	    break;
-
-	  case 'u' & 0x1f:
-	    while (cp > b)
-	      {
-		UART0_Putchar('\b', stream);
-		UART0_Putchar(' ', stream);
-		UART0_Putchar('\b', stream);
-		cp--;
-	      }
-	    break;
-
-	  case 'w' & 0x1f:
-	    while (cp > b && cp[-1] != ' ')
-	      {
-		UART0_Putchar('\b', stream);
-		UART0_Putchar(' ', stream);
-		UART0_Putchar('\b', stream);
-		cp--;
-	      }
-	    break;
-	  }
-      }
+  if (p->line_next == 0)
+    {
+#if IUART_LINE_MODE
+      if (p->line_mode)
+	{
+	  // echo what the RX interrupt left owing while waiting for the line
+	  while (!p->line_ready)
+	    {
+	      if (!(SREG & _BV(SREG_I)))
+		return _FDEV_ERR;
+	      uart_line_redraw(p, iuart_regs(port));
+	      IUART_SLEEP_UNTIL(p->line_ready || (!UART_LINE_SYNCED(p) && uart_tx_space(p)));
+	    }
+	  uart_line_redraw(p, iuart_regs(port));
+	  p->line_next = p->line;
+	}
+      else
+#endif
+      for (;;)
+	{
+	  rc = uart_wait_byte(p, port);
+	  if (rc < 0)
+	    return rc;
+	  rc = uart_line_input(p, iuart_regs(port), rc);
+	  uart_line_redraw(p, iuart_regs(port));
+	  if (rc < 0)
+	    return -1;
+	  if (rc > 0)
+	    {
+	      p->line_next = p->line;
+	      break;
+	    }
+	}
+    }
 
-  c = *rxp++;
+  c = *p->line_next++;
   if (c == '\n')
-    rxp = 0;
+    {
+      p->line_next = 0;
+#if IUART_LINE_MODE
+      if (p->line_mode)
+	iuart_line_release(port);
+#endif
+    }
 
   return c;
 }
 
+int iuart_getchar(FILE *stream)
+{
+  return iuart_getline_char(IUART_STREAM_PORT(stream));
+}
+
+int uart_getchar(FILE *stream)
+{
+  return iuart_getline_char(0);
+}
+
 //********************************
 //       INTERRUPT HANDLERS
 //********************************
 
-#if defined (__AVR_ATmega325__)
-ISR(USART0_RX_vect)
+// The handlers below are written once and expanded into the ISRs of every
+// enabled port with constant state and register addresses, so each ISR is as
+// cheap as a hand-written one for its USART.
+
+#if IUART_FLOW_CONTROL || IUART_XONXOFF
+// Stops the peer once the receive buffer is filled up to the high watermark,
+// by raising RTS or sending an XOFF.
+static inline __attribute__((always_inline)) void uart_rx_throttle(iuart_port_t *p, iuart_regs_t *r, uart_rx_index_t used)
+{
+#if IUART_FLOW_CONTROL
+	if (UART_FLOW(p) && used >= IUART_RTS_HIGH && !UART_RTS_IS_OFF()) {
+		IUART_RTS_PORT |= _BV(IUART_RTS_BIT);
+		p->counters.rx_throttled++;
+	}
+#endif
+#if IUART_XONXOFF
+	if (p->xonxoff && used >= IUART_XOFF_HIGH && !p->rx_stopped) {
+		p->rx_stopped = 1;
+		uart_tx_control(p, r, IUART_XOFF);
+		p->counters.rx_throttled++;
+	}
+#endif
+}
+#else
+#define uart_rx_throttle(p, r, used)
+#endif
+
+#if IUART_RTU
+// Restarts the silence timer: Timer1 compare B fires once the line has been
+// quiet for a whole gap, unless another byte comes in first.
+#define UART_RTU_REARM(p)															\
+	do { OCR1B = TCNT1 + (p)->rtu_gap; TIFR1 = _BV(OCF1B); TIMSK1 |= _BV(OCIE1B); } while (0)
+#endif
+
+#if IUART_FRAMES
+// Ends the frame being assembled past rx_next_free: publishes it, unless it
+// is empty, or is dropped for being damaged or finding the frame queue full.
+static inline __attribute__((always_inline)) void uart_frame_end(iuart_port_t *p, iuart_regs_t *r)
+{
+	uart_rx_index_t head = p->frame_head;
+	uart_rx_index_t len, used;
+	uint8_t slot;
+
+	len = (head - p->rx_next_free) & UART_RX_BUFFER_MASK;
+	slot = p->frame_next_free;
+#if IUART_CRC
+	// the CRC over the data followed by its own CRC comes out as 0
+	if (len && !p->frame_bad && !p->frame_esc && (len < IUART_CRC_BYTES || p->frame_crc != 0)) {
+		p->counters.rx_crc_errors++;
+		p->frame_bad = 1;
+	}
+	p->frame_crc = IUART_CRC_INIT;
+#endif
+	if (p->frame_bad || p->frame_esc ||
+		(len && (uint8_t)(slot - p->frame_next_to_read) == IUART_FRAME_QUEUE)) {
+		p->counters.rx_bad_frames++;
+		p->frame_head = p->rx_next_free;	// forget the decoded bytes
+	} else if (len) {
+#if IUART_CRC
+		p->frame_len[slot & (IUART_FRAME_QUEUE - 1)] = len - IUART_CRC_BYTES;
+#else
+		p->frame_len[slot & (IUART_FRAME_QUEUE - 1)] = len;
+#endif
+		IUART_BARRIER();
+		p->rx_next_free = head;
+		p->frame_next_free = slot + 1;
+		p->counters.rx_frames++;
+
+		used = (head - p->rx_next_to_read) & UART_RX_BUFFER_MASK;
+		if (used > p->counters.rx_high_water)
+			p->counters.rx_high_water = used;
+	}
+	p->frame_bad = 0;
+	p->frame_esc = 0;
+#if IUART_MULTIDROP
+	if (len && p->multidrop == IUART_MULTIDROP_NODE)
+		UART_MPCM_ON(r);		// done with this message, wait to be addressed again
+#endif
+}
+
+// Adds a data byte to the frame being assembled.
+static inline __attribute__((always_inline)) void uart_frame_store(iuart_port_t *p, iuart_regs_t *r, uint8_t c)
+{
+	uart_rx_index_t head = p->frame_head;
+
+	if (((head + 1) & UART_RX_BUFFER_MASK) == p->rx_next_to_read) {	// if buffer is full -
+		p->frame_bad = 1;
+		p->counters.rx_dropped++;
+		return;
+	}
+	p->rx_buffer[head] = c;
+	p->frame_head = (head + 1) & UART_RX_BUFFER_MASK;
+	uart_rx_throttle(p, r, (p->frame_head - p->rx_next_to_read) & UART_RX_BUFFER_MASK);
+#if IUART_CRC
+	p->frame_crc = uart_crc_update(p->frame_crc, c);
+#endif
+}
+
+// Decodes one received SLIP byte into the frame being assembled past
+// rx_next_free, and publishes the frame at its closing END.
+static inline __attribute__((always_inline)) void uart_frame_input(iuart_port_t *p, iuart_regs_t *r, uint8_t c)
 {
-#elif defined (__AVR_ATmega328P__)
-ISR(USART_RX_vect)
+	if (c == IUART_SLIP_END) {
+		uart_frame_end(p, r);
+		return;
+	}
+
+	if (p->frame_bad)
+		return;
+	if (c == IUART_SLIP_ESC) {
+		p->frame_esc = 1;
+		return;
+	}
+	if (p->frame_esc) {
+		p->frame_esc = 0;
+		if (c == IUART_SLIP_ESC_END)
+			c = IUART_SLIP_END;
+		else if (c == IUART_SLIP_ESC_ESC)
+			c = IUART_SLIP_ESC;
+		else {
+			p->frame_bad = 1;
+			return;
+		}
+	}
+	uart_frame_store(p, r, c);
+}
+#endif
+
+// Stores a received byte in the receive buffer, latching framing and parity
+// errors and overruns (including a full receive buffer) for the reader, and
+// counting them.
+static inline __attribute__((always_inline)) void iuart_rx_isr(iuart_port_t *p, iuart_regs_t *r)
 {
+	uint8_t status = r->ucsra & (_BV(FE0) | _BV(DOR0) | _BV(UPE0));	// error flags must be read before UDRn
+#if IUART_MULTIDROP
+	uint8_t bit9 = r->ucsrb & _BV(RXB80);	// and so must the 9th bit
+#endif
+	char c = r->udr;
+	uart_rx_index_t head = p->rx_next_free;
+	uart_rx_index_t next = (head + 1) & UART_RX_BUFFER_MASK;
+	uart_rx_index_t used;
+
+#if IUART_RS485 && IUART_RS485_NO_ECHO
+	if (UART_RS485(p) && p->sending_in_progress)	// our own transmission coming back
+		return;
+#endif
+
+#if IUART_RTU
+	if (UART_RTU(p) && p->frame_mode == IUART_FRAME_RTU)
+		UART_RTU_REARM(p);			// the line isn't quiet, whatever this byte turns out to be
+#endif
+
+	if (status) {					// the unlikely case, keep it off the fast path
+#if IUART_FRAMES
+		p->frame_bad = 1;			// whatever went wrong, the frame being received is damaged
 #endif
-	
-	ReceivedByte = UDR0; // Fetch the received byte value into the variable "ReceivedByte" 
+		if (status & _BV(DOR0))
+			p->counters.rx_overruns++;
+		if (status & _BV(UPE0))
+			p->counters.rx_parity++;
+		if (status & (_BV(FE0) | _BV(UPE0))) {	// framing or parity error, the byte is garbage
+			if (status & _BV(FE0))
+				p->counters.rx_framing++;
+			p->rx_status |= status;
+			return;
+		}
+		status &= _BV(DOR0);
+	}
+	p->counters.rx_bytes++;
+
+#if IUART_MULTIDROP
+	if (bit9 && p->multidrop == IUART_MULTIDROP_NODE) {	// an address frame
+		if ((uint8_t)c == p->address || (uint8_t)c == IUART_MPCM_BROADCAST) {
+			UART_MPCM_OFF(r);		// take the data frames that follow
+#if IUART_FRAMES
+			p->frame_head = p->rx_next_free;	// and start a fresh frame with them
+			p->frame_bad = 0;
+			p->frame_esc = 0;
+#if IUART_CRC
+			p->frame_crc = IUART_CRC_INIT;
+#endif
+#endif
+		} else
+			UART_MPCM_ON(r);		// someone else's, ignore it all
+		return;
+	}
+#endif
+
+#if IUART_XONXOFF
+	if (p->xonxoff && (c == IUART_XOFF || c == IUART_XON)) {	// flow control, not data
+		if (c == IUART_XON) {
+			p->tx_stopped = 0;
+			if (UART_TX_PENDING(p) && !p->tx_locked)	// else uart_tx_unlock() does it
+				r->ucsrb |= _BV(UDRIE0);
+		} else if (!p->tx_stopped) {
+			p->tx_stopped = 1;			// the Data Register Empty interrupt stops at its next byte
+			p->counters.tx_paused++;
+		}
+		return;
+	}
+#endif
+
+#if IUART_FRAMES
+	if (p->frame_mode) {
+		if (!UART_FRAME_SLIP(p)) {	// silence framing, the timer ends the frame
+			if (!p->frame_bad)
+				uart_frame_store(p, r, c);
+		} else
+			uart_frame_input(p, r, c);
+		return;
+	}
+#endif
+
+#if IUART_LINE_MODE
+	if (p->line_mode && !p->line_ready) {	// edit and echo right away
+		if (uart_line_input(p, r, c) > 0)
+			p->line_ready = 1;
+		p->rx_status |= status;
+		return;
+	}
+#endif
+
+	if (next == p->rx_next_to_read) {	// if buffer is full -
+		p->rx_status |= _BV(DOR0);				// then report it as an overrun
+		p->counters.rx_dropped++;
+		return;
+	}
+
+	p->rx_buffer[head] = c;			// store the byte before publishing it
+	IUART_BARRIER();
+	p->rx_next_free = next;
+	p->rx_status |= status;
+
+	used = (next - p->rx_next_to_read) & UART_RX_BUFFER_MASK;
+	if (used > p->counters.rx_high_water)
+		p->counters.rx_high_water = used;
+	uart_rx_throttle(p, r, used);
+}
+
+#if IUART_TX_BUFFERS
+// Starts on segment seg_iov of the buffer in the given slot.
+static inline __attribute__((always_inline)) void uart_seg_load(iuart_port_t *p, uint8_t slot)
+{
+	const iuart_iovec_t *iov = &p->seg[slot & (IUART_TX_BUFFERS - 1)].iov[p->seg_iov];
+
+	p->seg_ptr = iov->base;
+	p->seg_left = iov->len;
+	p->seg_flash = iov->in_flash;
 }
+#endif
 
-// This interrupt service routine is called when a byte has been sent through the
-// UART0 port, and it's ready to receive the next byte for transmission.
+// This interrupt service routine is called whenever UDRn is empty and ready to
+// accept the next byte for transmission, while the byte before it may still be
+// in the shift register.
 //
 // If there are more bytes to send, then send the next one and increment the index.
-// If the index reached the end of the buffer, then wrap around to the beginning.
+// The index wraps around to the beginning by masking with the buffer size.
 //
-// If there is not another byte to write, then clear the "UartSendingInProgress"
-// flag, otherwise set it if a byte has just been sent.
+// If there is not another byte to write, then disable this interrupt, otherwise
+// it would keep firing as long as UDRn stays empty.
 //
-#if defined (__AVR_ATmega325__)
-ISR(USART0_TX_vect)
-{
-#elif defined (__AVR_ATmega328P__)
-ISR(USART_TX_vect)
+static inline __attribute__((always_inline)) void iuart_udre_isr(iuart_port_t *p, iuart_regs_t *r)
 {
+	uart_tx_index_t tail = p->tx_next_to_send;
+
+#if IUART_XONXOFF
+	if (p->tx_control) {			// XON/XOFF go first, stopped or not
+		r->udr = p->tx_control;
+		p->tx_control = 0;
+		p->counters.tx_bytes++;
+		return;
+	}
+#endif
+
+#if IUART_TX_BUFFERS
+	// a handed over buffer is due once the output buffer has been sent up to its position
+	uint8_t slot = p->seg_next_to_send;
+	uint8_t due = !p->seg_left && slot != p->seg_next_free &&
+				  p->seg[slot & (IUART_TX_BUFFERS - 1)].at == tail;
+
+	if (tail == p->tx_next_free && !p->seg_left && !due && !UART_PRIO_PENDING(p)) {
+#else
+	if (tail == p->tx_next_free && !UART_PRIO_PENDING(p)) {  // if nothing to send
 #endif
 
-	if (UartBufferNextByteToSend == UartBufferNextFree) {  // if nothing to send
-	
-		UartSendingInProgress = 0;  // clear "sending in progress" flag
+		r->ucsrb &= ~_BV(UDRIE0);	// stop the interrupt until new data is queued
 		return; 					// then we have nothing to do, so return
 	}
 
-	// set "sending in progress" flag
-	UartSendingInProgress = 1;
+#if IUART_FLOW_CONTROL
+	if (UART_FLOW(p) && UART_CTS_IS_OFF()) {	// the peer can't take more
+		// arm the CTS interrupt first, then look again, so a change in
+		// between isn't missed
+		IUART_CTS_PCMSK |= _BV(IUART_CTS_PCINT);
+		if (UART_CTS_IS_OFF()) {
+			r->ucsrb &= ~_BV(UDRIE0);	// paused until CTS goes low
+			p->counters.tx_paused++;
+			return;
+		}
+	}
+#endif
+
+#if IUART_XONXOFF
+	if (p->tx_stopped) {			// XOFF received, wait for the XON
+		r->ucsrb &= ~_BV(UDRIE0);
+		return;
+	}
+#endif
+
+#if IUART_TX_PRIO
+	if (UART_PRIO_PENDING(p)) {		// output from other interrupts goes first
+		uint8_t prio = p->prio_next_to_send;
+
+		IUART_BARRIER();
+		r->udr = p->prio_buffer[prio];
+		p->counters.tx_bytes++;
+		p->prio_next_to_send = (prio + 1) & UART_PRIO_MASK;
+		return;
+	}
+#endif
+
+#if IUART_TX_BUFFERS
+	if (due) {
+		IUART_BARRIER();
+		p->seg_iov = 0;
+#if IUART_COOKED
+		p->seg_onlcr = p->seg[slot & (IUART_TX_BUFFERS - 1)].onlcr;
+		p->seg_cr = 0;
+#endif
+		uart_seg_load(p, slot);
+	}
+	if (p->seg_left) {				// streaming from a handed over buffer
+		uint8_t c = p->seg_flash ? pgm_read_byte(p->seg_ptr) : *p->seg_ptr;
+
+#if IUART_COOKED
+		if (c == '\n' && p->seg_onlcr && !p->seg_cr) {
+			r->udr = '\r';			// the newline goes out next time
+			p->seg_cr = 1;
+			p->counters.tx_bytes++;
+			return;
+		}
+		p->seg_cr = 0;
+#endif
+		r->udr = c;
+		p->seg_ptr++;
+		p->counters.tx_bytes++;
+		if (--p->seg_left == 0) {
+			if (++p->seg_iov < p->seg[slot & (IUART_TX_BUFFERS - 1)].iovcnt)
+				uart_seg_load(p, slot);		// on to the next segment
+			else {
+				p->seg_next_to_send = slot + 1;
+				if (p->seg_done)
+					p->seg_done(p->seg[slot & (IUART_TX_BUFFERS - 1)].iov[0].base);
+			}
+		}
+		return;
+	}
+#endif
+
+	// send the next byte on the UART port
+	IUART_BARRIER();
+	r->udr = p->tx_buffer[tail];
+	p->counters.tx_bytes++;
+
+	// increment index, wrapping around at the end of the buffer
+	p->tx_next_to_send = (tail + 1) & UART_BUFFER_MASK;
+}
+
+// This interrupt service routine is called when the last byte has left the shift
+// register and no new byte was waiting in UDRn, i.e. at the end of a burst of
+// output. It is only used for end-of-frame detection.
+//
+// Clear the "sending in progress" flag, unless more data was queued in the
+// meantime and the Data Register Empty interrupt is about to send it. On the
+// RS-485 port, release the bus right away: the last stop bit is out.
+//
+static inline __attribute__((always_inline)) void iuart_tx_isr(iuart_port_t *p, iuart_regs_t *r)
+{
+	if (!UART_TX_PENDING(p) && !(r->ucsrb & _BV(UDRIE0))) {
+		p->sending_in_progress = 0;  // clear "sending in progress" flag
+#if IUART_RS485
+		if (UART_RS485(p))
+			IUART_DE_PORT &= ~_BV(IUART_DE_BIT);
+#endif
+	}
+}
+
+// In an instrumented build every handler is timed from its first to its last
+// statement; the register saving done by the compiler around it is not included.
+#define IUART_ISRS(n, rx_vect, udre_vect, tx_vect)										\
+	ISR(rx_vect)   { IUART_ISR_ENTER(); iuart_rx_isr(&iuart_port##n, IUART_REGS(n));	\
+					 IUART_ISR_EXIT(&iuart_port##n, rx); }								\
+	ISR(udre_vect) { IUART_ISR_ENTER(); iuart_udre_isr(&iuart_port##n, IUART_REGS(n));	\
+					 IUART_ISR_EXIT(&iuart_port##n, udre); }							\
+	ISR(tx_vect)   { IUART_ISR_ENTER(); iuart_tx_isr(&iuart_port##n, IUART_REGS(n));	\
+					 IUART_ISR_EXIT(&iuart_port##n, tx); }
+
+#if IUART_FLOW_CONTROL
+// Resumes paused output once CTS is low again. Disarms itself; the Data
+// Register Empty interrupt arms it again should CTS go high once more.
+ISR(IUART_CTS_vect)
+{
+	iuart_port_t *p = &UART_PORT_STATE(IUART_FLOW_PORT);
+
+	if (!UART_CTS_IS_OFF()) {
+		IUART_CTS_PCMSK &= ~_BV(IUART_CTS_PCINT);
+		if (UART_TX_PENDING(p))
+			iuart_regs(IUART_FLOW_PORT)->ucsrb |= _BV(UDRIE0);
+	}
+}
+#endif
+
+#if IUART_RTU
+// The line has been quiet for a whole gap since the last byte, so the frame
+// received so far is complete. Disarms itself until the next byte comes in.
+ISR(TIMER1_COMPB_vect)
+{
+	TIMSK1 &= ~_BV(OCIE1B);
+	uart_frame_end(&UART_PORT_STATE(IUART_RTU_PORT), iuart_regs(IUART_RTU_PORT));
+}
+#endif
 
-	// send the next byte on UART0 port
-	UDR0 = UartBuffer[UartBufferNextByteToSend];
+#if IUART_AUTOBAUD
+// A falling edge on RXD, through ICP1, while iuart_autobaud() measures.
+ISR(TIMER1_CAPT_vect)
+{
+	uart_autobaud_edge(ICR1);
+}
 
-	// increment index and check for wrap-around
-	UartBufferNextByteToSend++;
-	if (UartBufferNextByteToSend == UART_BUFFER_SIZE)	// if we reached the end of the buffer -
-	UartBufferNextByteToSend = 0; 				 		// then start back at the beginning
+// Extends Timer1 for iuart_autobaud(), which masks this again when done.
+ISR(TIMER1_OVF_vect)
+{
+	uart_autobaud.high++;
 }
+#endif
+
+// Single-USART parts such as the ATmega328P name their vectors without a number.
+#if IUART_USE_USART0
+#if defined (USART_RX_vect)
+IUART_ISRS(0, USART_RX_vect, USART_UDRE_vect, USART_TX_vect)
+#else
+IUART_ISRS(0, USART0_RX_vect, USART0_UDRE_vect, USART0_TX_vect)
+#endif
+#endif
+
+#if IUART_USE_USART1
+IUART_ISRS(1, USART1_RX_vect, USART1_UDRE_vect, USART1_TX_vect)
+#endif
+
+#if IUART_USE_USART2
+IUART_ISRS(2, USART2_RX_vect, USART2_UDRE_vect, USART2_TX_vect)
+#endif
+
+#if IUART_USE_USART3
+IUART_ISRS(3, USART3_RX_vect, USART3_UDRE_vect, USART3_TX_vect)
+#endif
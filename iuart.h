@@ -11,24 +11,614 @@
 #ifndef _IUART_H_
 #define _IUART_H_
 
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
 
-#define USART_BAUDRATE	 	9600
+#ifndef USART_BAUDRATE
+#define USART_BAUDRATE	 	9600		// baud rate set by iuart_init(), see iuart_set_baud()
+#endif
 #define BAUD_PRESCALE 		(((F_CPU / (USART_BAUDRATE * 16UL))) - 1)
-#define UART_BUFFER_SIZE	256	
+#ifndef UART_BUFFER_SIZE
+#define UART_BUFFER_SIZE	256			// must be a power of two
+#endif
 #define RX_BUFSIZE 			80
 
+// USARTs driven by this library. Each enabled port gets its own buffers and
+// interrupt handlers; ports are numbered like the USARTs (0 for USART0 etc.).
+#ifndef IUART_USE_USART0
+#define IUART_USE_USART0	1
+#endif
+#ifndef IUART_USE_USART1
+#define IUART_USE_USART1	0
+#endif
+#ifndef IUART_USE_USART2
+#define IUART_USE_USART2	0
+#endif
+#ifndef IUART_USE_USART3
+#define IUART_USE_USART3	0
+#endif
 
-char UartBuffer[UART_BUFFER_SIZE]; 		// this is a wrap-around buffer
-int  UartBufferNextByteToSend; 			// position of next byte to be sent
-int  UartBufferNextFree;				// position of next free byte of buffer
-int  UartSendingInProgress; 			// 1 = sending is in progress
+#if !(IUART_USE_USART0 || IUART_USE_USART1 || IUART_USE_USART2 || IUART_USE_USART3)
+#error "no USART enabled"
+#endif
 
-//Initialise UART and set all the parameters
+// Frame formats for iuart_config(): one data size, one parity and one stop
+// bit setting OR-ed together, e.g. IUART_DATA7 | IUART_PARITY_EVEN |
+// IUART_STOP1. The values are the UCSRnC bits for asynchronous mode.
+#define IUART_DATA5			0x00
+#define IUART_DATA6			0x02
+#define IUART_DATA7			0x04
+#define IUART_DATA8			0x06
+#define IUART_PARITY_NONE	0x00
+#define IUART_PARITY_EVEN	0x20
+#define IUART_PARITY_ODD	0x30
+#define IUART_STOP1			0x00
+#define IUART_STOP2			0x08
+#define IUART_FORMAT_MASK	0x3e
+
+#define IUART_8N1			(IUART_DATA8 | IUART_PARITY_NONE | IUART_STOP1)
+#define IUART_8N2			(IUART_DATA8 | IUART_PARITY_NONE | IUART_STOP2)
+#define IUART_8E1			(IUART_DATA8 | IUART_PARITY_EVEN | IUART_STOP1)
+#define IUART_8O1			(IUART_DATA8 | IUART_PARITY_ODD | IUART_STOP1)
+#define IUART_7E1			(IUART_DATA7 | IUART_PARITY_EVEN | IUART_STOP1)
+#define IUART_7O1			(IUART_DATA7 | IUART_PARITY_ODD | IUART_STOP1)
+
+#ifndef IUART_FORMAT
+#define IUART_FORMAT		IUART_8N1	// frame format set by iuart_init()
+#endif
+
+// What to do when a byte is queued while the output buffer is full
+#define UART_TX_BLOCK		0			// sleep until the interrupt has made room
+#define UART_TX_FAIL		1			// reject the byte right away (EOF / short count)
+#define UART_TX_DROP_OLDEST	2			// overwrite the oldest unsent byte
+
+#ifndef UART_TX_POLICY
+#define UART_TX_POLICY		UART_TX_FAIL	// policy selected by init_iuart()
+#endif
+
+// Terminal style processing of each port's text, see iuart_set_mode().
+// Building with IUART_COOKED set to 0 leaves it all out: every port is raw,
+// iuart_putc() queues bytes as they are and uart_getchar() returns them as
+// they arrive, with no echo.
+#ifndef IUART_COOKED
+#define IUART_COOKED		1
+#endif
+
+#define IUART_ONLCR			0x01		// send a carriage return before each newline
+#define IUART_ICRNL			0x02		// take a received carriage return as a newline
+#define IUART_ECHO			0x04		// echo the input being edited into lines
+#define IUART_ICANON		0x08		// the getchar hooks return edited lines, not single bytes
+
+#ifndef IUART_MODE
+#define IUART_MODE			(IUART_ONLCR | IUART_ICRNL | IUART_ECHO | IUART_ICANON)	// mode set by iuart_init()
+#endif
+
+// RTS/CTS hardware flow control on port IUART_FLOW_PORT, using two GPIO pins,
+// both active low like on the RS-232 side of a level shifter:
+//  . RTS, an output: IUART_RTS_PORT, IUART_RTS_DDR, IUART_RTS_BIT (e.g. PORTD,
+//    DDRD, PD4). Raised once the receive buffer holds IUART_RTS_HIGH bytes,
+//    lowered again when reading has brought it down to IUART_RTS_LOW.
+//  . CTS, an input: IUART_CTS_PIN, IUART_CTS_BIT (e.g. PIND, PD5). Output
+//    pauses while it is high, and resumes from its pin change interrupt:
+//    IUART_CTS_PCMSK, IUART_CTS_PCINT, IUART_CTS_PCIE, IUART_CTS_vect (e.g.
+//    PCMSK2, PCINT21, PCIE2, PCINT2_vect). The driver owns that vector.
+// Leave the peer room for the bytes it still sends after RTS goes up.
+#ifndef IUART_FLOW_CONTROL
+#define IUART_FLOW_CONTROL	0
+#endif
+#ifndef IUART_FLOW_PORT
+#define IUART_FLOW_PORT		0
+#endif
+#ifndef IUART_RTS_HIGH
+#define IUART_RTS_HIGH		(UART_RX_BUFFER_SIZE - UART_RX_BUFFER_SIZE / 4)
+#endif
+#ifndef IUART_RTS_LOW
+#define IUART_RTS_LOW		(UART_RX_BUFFER_SIZE / 4)
+#endif
+
+// RS-485 half duplex on port IUART_RS485_PORT: the transceiver's driver
+// enable, on IUART_DE_PORT, IUART_DE_DDR, IUART_DE_BIT (e.g. PORTD, DDRD, PD2),
+// is raised as soon as anything is queued and dropped by the TX Complete
+// interrupt once the last stop bit is out. With IUART_RS485_NO_ECHO the
+// bytes received while sending, our own echo when the receiver stays
+// enabled, are thrown away.
+#ifndef IUART_RS485
+#define IUART_RS485			0
+#endif
+#ifndef IUART_RS485_PORT
+#define IUART_RS485_PORT	0
+#endif
+#ifndef IUART_RS485_NO_ECHO
+#define IUART_RS485_NO_ECHO	1
+#endif
+
+// 9-bit multidrop buses using the multi-processor communication mode (MPCM),
+// see iuart_set_multidrop(). An addressed node only takes RX interrupts for
+// address frames until its own address, or IUART_MPCM_BROADCAST, comes by.
+#ifndef IUART_MULTIDROP
+#define IUART_MULTIDROP		0
+#endif
+#ifndef IUART_MPCM_BROADCAST
+#define IUART_MPCM_BROADCAST	0xff	// address every node accepts
+#endif
+
+#define IUART_MULTIDROP_OFF		0		// plain 8-bit frames
+#define IUART_MULTIDROP_MASTER	1		// 9-bit frames, sends address frames, receives everything
+#define IUART_MULTIDROP_NODE	2		// 9-bit frames, receives only while addressed
+
+// XON/XOFF software flow control, see iuart_set_xonxoff(). An XOFF is sent
+// once the receive buffer holds IUART_XOFF_HIGH bytes, an XON when reading
+// has brought it down to IUART_XON_LOW; USB serial bridges may take a whole
+// USB packet to react, so leave room for that.
+#ifndef IUART_XONXOFF
+#define IUART_XONXOFF		0
+#endif
+#ifndef IUART_XOFF_HIGH
+#define IUART_XOFF_HIGH		(UART_RX_BUFFER_SIZE - UART_RX_BUFFER_SIZE / 4)
+#endif
+#ifndef IUART_XON_LOW
+#define IUART_XON_LOW		(UART_RX_BUFFER_SIZE / 4)
+#endif
+
+#define IUART_XON			0x11		// ^q, resume output
+#define IUART_XOFF			0x13		// ^s, stop output
+
+// Line mode support: the RX interrupt runs the line editor and echoes as
+// characters arrive, see iuart_set_line_mode(). Costs a few cycles per RX
+// interrupt when compiled in, even on ports not using it.
+#ifndef IUART_LINE_MODE
+#define IUART_LINE_MODE		0
+#endif
+
+// SLIP framing of binary packets, see iuart_set_frame_mode(). In frame mode
+// the RX interrupt decodes the frames straight into the receive buffer and
+// queues up to IUART_FRAME_QUEUE completed ones for iuart_frame_read().
+#ifndef IUART_FRAMES
+#define IUART_FRAMES		0
+#endif
+#ifndef IUART_FRAME_QUEUE
+#define IUART_FRAME_QUEUE	4			// completed frames held, a power of two up to 128
+#endif
+
+#define IUART_FRAME_OFF		0			// bytes are handed out one by one
+#define IUART_FRAME_SLIP	1			// frames delimited by IUART_SLIP_END
+#define IUART_FRAME_RTU		2			// frames delimited by silence, Modbus RTU style
+
+// Silence framing (IUART_FRAME_RTU) on IUART_RTU_PORT: a frame ends once the
+// line has been quiet for 3.5 characters at the current baud rate and frame
+// format, or for 1750us above 19200 baud, as Modbus RTU has it. The RX
+// interrupt arms Timer1 compare B for that on every byte, which iuart_init()
+// runs free with the clock divided by IUART_RTU_PRESCALE (1, 8, 64, 256 or
+// 1024); to share Timer1 with other code, keep it in normal mode at that
+// prescaler and leave OCR1B alone. Needs IUART_FRAMES.
+#ifndef IUART_RTU
+#define IUART_RTU			0
+#endif
+#ifndef IUART_RTU_PORT
+#define IUART_RTU_PORT		0
+#endif
+#ifndef IUART_RTU_PRESCALE
+#define IUART_RTU_PRESCALE	64			// 4us ticks at 16MHz, gaps up to 262ms
+#endif
+
+#define IUART_SLIP_END		0xc0		// frame delimiter
+#define IUART_SLIP_ESC		0xdb		// escapes the next byte
+#define IUART_SLIP_ESC_END	0xdc		// escaped IUART_SLIP_END
+#define IUART_SLIP_ESC_ESC	0xdd		// escaped IUART_SLIP_ESC
+
+// CRC of framed data, accumulated byte by byte as it passes through the
+// driver: 16 for CRC-16/MODBUS (polynomial 0xa001 reflected, start 0xffff,
+// sent low byte first), 8 for CRC-8 (polynomial 0x07, start 0), 0 for none.
+// With frame mode, iuart_frame_send() appends it and received frames whose
+// CRC doesn't check are dropped; iuart_write() keeps a running CRC as well,
+// see iuart_tx_crc(). IUART_CRC_TABLE trades 256 (CRC-8) or 512 (CRC-16)
+// bytes of flash for a faster update than the avr-libc <util/crc16.h> one.
+#ifndef IUART_CRC
+#define IUART_CRC			0
+#endif
+#ifndef IUART_CRC_TABLE
+#define IUART_CRC_TABLE		0
+#endif
+
+// Zero-copy transmission of caller-owned buffers, see iuart_send_buffer():
+// the number of buffers that can be handed over at a time, a power of two
+// (2 for ping-pong use), or 0 to leave the feature out.
+#ifndef IUART_TX_BUFFERS
+#define IUART_TX_BUFFERS	0
+#endif
+#ifndef IUART_TX_IOV
+#define IUART_TX_IOV		4			// most segments in one iuart_writev() call
+#endif
+
+// Output from other interrupt handlers, see iuart_try_putc(): the size of a
+// second, small output ring per port, a power of two up to 256, which only
+// interrupt context fills and the Data Register Empty interrupt drains ahead
+// of the output buffer. 0 leaves it out.
+#ifndef IUART_TX_PRIO
+#define IUART_TX_PRIO		0
+#endif
+
+// Autobaud on port IUART_AUTOBAUD_PORT, see iuart_autobaud(): the Timer1
+// input capture unit times the edges of a 'U' sent by the peer, so ICP1 must
+// be wired to the port's RXD (e.g. PB0 to PD0 on the ATmega328P). The driver
+// then owns the Timer1 input capture and overflow interrupts.
+#ifndef IUART_AUTOBAUD
+#define IUART_AUTOBAUD		0
+#endif
+#ifndef IUART_AUTOBAUD_PORT
+#define IUART_AUTOBAUD_PORT	0
+#endif
+
+// Binary logging, see iuart_log(): instead of text, a record of the format
+// string's flash address and the raw arguments, which tools/iuart_log.py
+// turns back into text on the host, using the firmware image.
+#ifndef IUART_LOG
+#define IUART_LOG			0
+#endif
+
+// Instrumented build: times every UART ISR and the longest time the output
+// buffer interrupts stay masked, in Timer1 ticks, see iuart_stats(). With
+// IUART_INSTRUMENT_TIMER1, iuart_init() runs Timer1 free at the CPU clock so
+// ticks are cycles; otherwise Timer1 is left as the application set it up.
+// Defining IUART_PROBE_PORT, IUART_PROBE_DDR and IUART_PROBE_BIT (e.g. PORTB,
+// DDRB, PB0) also drives that pin high for the duration of each ISR.
+#ifndef IUART_INSTRUMENT
+#define IUART_INSTRUMENT		0
+#endif
+#ifndef IUART_INSTRUMENT_TIMER1
+#define IUART_INSTRUMENT_TIMER1	1
+#endif
+
+#ifndef UART_RX_BUFFER_SIZE
+#define UART_RX_BUFFER_SIZE	64			// size of the interrupt-filled receive buffer, a power of two
+#endif
+
+// The buffers wrap around by masking, so their sizes must be powers of two.
+// Up to 256 bytes the indices are single bytes, which the ISRs read and write
+// atomically and without any carry arithmetic. Larger buffers get 16-bit
+// indices, which the main line accesses with interrupts briefly disabled.
+#if (UART_BUFFER_SIZE & (UART_BUFFER_SIZE - 1)) != 0 || UART_BUFFER_SIZE < 2
+#error "UART_BUFFER_SIZE must be a power of two"
+#endif
+#if (UART_RX_BUFFER_SIZE & (UART_RX_BUFFER_SIZE - 1)) != 0 || UART_RX_BUFFER_SIZE < 2
+#error "UART_RX_BUFFER_SIZE must be a power of two"
+#endif
+
+#if (IUART_FRAME_QUEUE & (IUART_FRAME_QUEUE - 1)) != 0 || IUART_FRAME_QUEUE > 128
+#error "IUART_FRAME_QUEUE must be a power of two up to 128"
+#endif
+
+#if (IUART_TX_BUFFERS & (IUART_TX_BUFFERS - 1)) != 0 || IUART_TX_BUFFERS > 128
+#error "IUART_TX_BUFFERS must be 0 or a power of two up to 128"
+#endif
+
+#if (IUART_FORMAT & ~IUART_FORMAT_MASK) != 0 || (IUART_FORMAT & IUART_PARITY_ODD) == 0x10
+#error "IUART_FORMAT must be made of IUART_DATAn, IUART_PARITY_x and IUART_STOPn"
+#endif
+
+#if IUART_RTU && !IUART_FRAMES
+#error "IUART_RTU needs IUART_FRAMES"
+#endif
+#if IUART_RTU && IUART_RTU_PRESCALE != 1 && IUART_RTU_PRESCALE != 8 && IUART_RTU_PRESCALE != 64 && \
+	IUART_RTU_PRESCALE != 256 && IUART_RTU_PRESCALE != 1024
+#error "IUART_RTU_PRESCALE must be 1, 8, 64, 256 or 1024"
+#endif
+#if IUART_RTU && IUART_INSTRUMENT && IUART_INSTRUMENT_TIMER1 && IUART_RTU_PRESCALE != 1
+#error "IUART_INSTRUMENT_TIMER1 runs Timer1 at the CPU clock, set IUART_RTU_PRESCALE to 1"
+#endif
+
+#if (IUART_TX_PRIO & (IUART_TX_PRIO - 1)) != 0 || IUART_TX_PRIO > 256
+#error "IUART_TX_PRIO must be 0 or a power of two up to 256"
+#endif
+
+#if IUART_CRC != 0 && IUART_CRC != 8 && IUART_CRC != 16
+#error "IUART_CRC must be 0, 8 or 16"
+#endif
+
+#define UART_BUFFER_MASK	(UART_BUFFER_SIZE - 1)
+#define UART_RX_BUFFER_MASK	(UART_RX_BUFFER_SIZE - 1)
+
+#if UART_BUFFER_SIZE <= 256
+typedef uint8_t  uart_tx_index_t;
+#else
+typedef uint16_t uart_tx_index_t;
+#endif
+
+#if UART_RX_BUFFER_SIZE <= 256
+typedef uint8_t  uart_rx_index_t;
+#else
+typedef uint16_t uart_rx_index_t;
+#endif
+
+#if IUART_CRC == 16
+typedef uint16_t iuart_crc_t;
+#define IUART_CRC_INIT		0xffff
+#define IUART_CRC_BYTES		2
+#elif IUART_CRC == 8
+typedef uint8_t  iuart_crc_t;
+#define IUART_CRC_INIT		0
+#define IUART_CRC_BYTES		1
+#endif
+
+
+// Per-port counters, read with iuart_get_counters()
+typedef struct
+{
+	uint32_t rx_bytes;			// bytes received without error
+	uint32_t tx_bytes;			// bytes handed to the transmitter
+	uint16_t rx_overruns;		// hardware data overruns (DOR), bytes lost before the RX interrupt ran
+	uint16_t rx_framing;		// framing errors (FE), e.g. line breaks or a baud rate mismatch
+	uint16_t rx_parity;			// parity errors (UPE), only with parity enabled; the byte is dropped
+	uint16_t rx_dropped;		// bytes thrown away because the receive buffer was full
+	uart_rx_index_t rx_high_water;	// most bytes ever waiting in the receive buffer
+	uart_tx_index_t tx_high_water;	// most bytes ever waiting in the output buffer
+	uint32_t tx_blocked;		// times a writer had to sleep waiting for room (UART_TX_BLOCK)
+	uint32_t tx_failed;			// bytes rejected because the buffer was full (UART_TX_FAIL)
+	uint32_t tx_overwritten;	// queued bytes discarded to make room (UART_TX_DROP_OLDEST)
+	uint32_t rx_frames;			// frames received intact, in frame mode
+	uint16_t rx_bad_frames;		// frames thrown away: receive errors, bad escapes, no room, bad CRC
+	uint16_t rx_crc_errors;		// frames among those whose CRC didn't check
+	uint16_t rx_throttled;		// times the peer was stopped, raising RTS or sending XOFF
+	uint16_t tx_paused;			// times output stopped for CTS going high or an XOFF received
+	uint16_t tx_prio_failed;	// bytes iuart_try_putc() and iuart_try_write() found no room for
+} iuart_counters_t;
+
+/* All routines taking a port number only accept the number of an enabled
+ * USART. The UART0_* routines, init_iuart() and uart_getchar() work on
+ * port 0, as they always did. */
+
+#if IUART_INSTRUMENT
+// Timing of one interrupt handler, in Timer1 ticks
+typedef struct
+{
+	uint16_t min;
+	uint16_t max;
+	uint16_t avg;				// filled in by iuart_stats()
+	uint16_t count;				// calls measured, saturates at 65535
+	uint32_t total;
+} iuart_isr_stat_t;
+
+typedef struct
+{
+	iuart_isr_stat_t rx;		// RX complete
+	iuart_isr_stat_t udre;		// data register empty
+	iuart_isr_stat_t tx;		// TX complete
+	uint16_t max_masked;		// longest window with the output buffer interrupts masked
+} iuart_stats_t;
+
+//Take a consistent snapshot of the ISR timing statistics
+void iuart_stats(uint8_t port, iuart_stats_t *stats);
+
+//Start measuring from scratch
+void iuart_stats_reset(uint8_t port);
+#endif
+
+//Initialise a UART port and set all the parameters
+void iuart_init(uint8_t port);
+
+//Initialise UART0 and set all the parameters
 void init_iuart(void);
 
+//Change the baud rate at runtime, returns the achieved error in 0.01% units
+int16_t iuart_set_baud(uint8_t port, uint32_t baud);
+
+//Baud rate last selected with iuart_set_baud()
+uint32_t iuart_get_baud(uint8_t port);
+
+#if IUART_AUTOBAUD
+/* Waits up to timeout_ms for the peer to send a 'U' (0x55) in 8N1 or
+ * 7E1, whose edges are one bit apart, measures it and switches to the
+ * nearest standard rate from 2400 to 250000 baud.  Returns the rate, or
+ * 0 if none was recognised in time or interrupts are disabled.  Meant
+ * for bringing a link up. */
+uint32_t iuart_autobaud(uint8_t port, uint16_t timeout_ms);
+#endif
+
+//Change the frame format at runtime (e.g. IUART_7E1), returns EOF for an invalid format
+int iuart_config(uint8_t port, uint8_t format);
+
+//Frame format last selected with iuart_config()
+uint8_t iuart_get_config(uint8_t port);
+
+//Select what happens when the output buffer is full (UART_TX_BLOCK, UART_TX_FAIL, UART_TX_DROP_OLDEST)
+void iuart_set_tx_policy(uint8_t port, uint8_t policy);
+
+//Take a consistent snapshot of the port counters
+void iuart_get_counters(uint8_t port, iuart_counters_t *counters);
+
+//Clear the port counters, including the high-water marks
+void iuart_reset_counters(uint8_t port);
+
+#if IUART_COOKED
+//Select the processing of a port's text, any of IUART_ONLCR, IUART_ICRNL, IUART_ECHO, IUART_ICANON
+void iuart_set_mode(uint8_t port, uint8_t mode);
+
+//Processing selected with iuart_set_mode()
+uint8_t iuart_get_mode(uint8_t port);
+#endif
+
+//Returns 1 while bytes are still on their way out of the UART
+uint8_t iuart_tx_busy(uint8_t port);
+
+//Sleep until everything queued has been sent, returns EOF if interrupts are disabled
+int iuart_flush(uint8_t port);
+
+//Returns a bit per port (bit n for port n) still sending; sleep no deeper than idle while it is non-zero
+uint8_t iuart_busy(void);
+
+//Queue one character, adding a carriage return before a newline with IUART_ONLCR
+int iuart_putc(uint8_t port, char c);
+
+//Queue a block of raw bytes for transmission, returns how many were accepted
+size_t iuart_write(uint8_t port, const uint8_t *buf, size_t len);
+
+/* Small printf() formatting straight into the output buffer: %c %s %S
+ * %d %i %u %x %X, l, -, 0, width, and a precision that prints decimal
+ * integers as fixed point ("%.2d" of 1234 is "12.34"); on %x and %X it
+ * is the minimum number of digits. The _P variants take the format
+ * from flash. */
+int iuart_printf(uint8_t port, const char *fmt, ...);
+int iuart_printf_P(uint8_t port, const char *fmt, ...);
+int iuart_vprintf(uint8_t port, const char *fmt, va_list ap);
+int iuart_vprintf_P(uint8_t port, const char *fmt, va_list ap);
+
+#if IUART_LOG
+/* Binary logging.  Queues one SLIP framed record (see IUART_SLIP_END):
+ * the flash address of fmt, then each argument as it is, little-endian:
+ * 2 bytes for %d %i %u %x %X %o %p and each * width, 4 with l, 1 for %c,
+ * a 4-byte float for %e %f %g, and %s (RAM) and %S (flash) strings with
+ * their terminating NUL.  Flags, width and precision cost nothing.
+ * Nothing is formatted on the target; the host looks the format up at
+ * that address in the firmware image.  Use IUART_LOGF(), which places
+ * the format in the .progmem.iuart_log section of flash. */
+#define IUART_LOG_FMT(s)	(__extension__({ static const char __c[] __attribute__((__section__(".progmem.iuart_log"))) = (s); &__c[0]; }))
+#define IUART_LOGF(port, fmt, ...)	iuart_log(port, IUART_LOG_FMT(fmt), ##__VA_ARGS__)
+void iuart_log(uint8_t port, const char *fmt, ...);
+void iuart_vlog(uint8_t port, const char *fmt, va_list ap);
+#endif
+
+/* Send text or bytes from flash.  With IUART_TX_BUFFERS they take no room
+ * in the output buffer: the interrupt reads them from flash as it sends
+ * them, see iuart_writev(); otherwise, or when no buffer slot is free
+ * and the port's policy doesn't wait for one, they are copied in like
+ * iuart_printf() output.  iuart_puts_P() adds a carriage return before
+ * each newline with IUART_ONLCR, and no newline at the end.  Both return
+ * 0, or EOF if UART_TX_FAIL dropped any of it for lack of room. */
+int iuart_puts_P(uint8_t port, const char *s);
+int iuart_write_P(uint8_t port, const uint8_t *buf, uint16_t len);
+
+//Fetch one raw byte from the receive buffer, returns EOF if it is empty
+int iuart_getc(uint8_t port);
+
+//Number of bytes waiting in the receive buffer
+int iuart_rx_available(uint8_t port);
+
+/* Receive one character from the UART.  The actual reception is
+ * line-buffered (unless IUART_ICANON is off), and one character is
+ * returned from the buffer at each invokation. */
+int iuart_getline_char(uint8_t port);
+
+#if IUART_LINE_MODE
+//Assemble and echo lines from the RX interrupt instead of from the getchar calls
+void iuart_set_line_mode(uint8_t port, uint8_t on);
+#endif
+
+#if IUART_MULTIDROP
+//Select the port's role on a multidrop bus (IUART_MULTIDROP_*) and, for a node, its address
+void iuart_set_multidrop(uint8_t port, uint8_t mode, uint8_t address);
+
+//Ignore data again until the node is addressed once more
+void iuart_mpcm_rearm(uint8_t port);
+
+//Send an address frame once queued output is out, returns EOF if interrupts are disabled
+int iuart_send_address(uint8_t port, uint8_t address);
+#endif
+
+#if IUART_XONXOFF
+//Turn XON/XOFF flow control on or off; off resumes output and sends an XON if needed
+void iuart_set_xonxoff(uint8_t port, uint8_t on);
+#endif
+
+//Returns 1 once a complete line is being held
+uint8_t iuart_line_ready(uint8_t port);
+
+/* Returns the next completed line in place, terminated by "\n\0", or
+ * NULL if there is none yet; *len is set to its length without the \n.
+ * The line may be modified and stays valid until iuart_line_release(). */
+char *iuart_getline(uint8_t port, uint8_t *len);
+
+//Hand the line buffer back for the next line
+void iuart_line_release(uint8_t port);
+
+#if IUART_TX_BUFFERS
+// Called from the Data Register Empty interrupt once the last byte of a
+// buffer handed to iuart_send_buffer() has been loaded into the USART
+typedef void (*iuart_tx_done_t)(const uint8_t *buf);
+
+// One segment for iuart_writev()
+typedef struct
+{
+	const void *base;
+	uint16_t len;
+	uint8_t in_flash;			// 1 = base points into program memory (the lower 64 KiB)
+} iuart_iovec_t;
+
+/* Sends a buffer straight from where it is, without copying it into the
+ * output buffer, in order with everything else queued on the port.  The
+ * buffer must stay untouched until it is done.  Returns 0, or EOF if
+ * IUART_TX_BUFFERS buffers are pending already and the port's policy
+ * doesn't let it wait (only UART_TX_BLOCK does). */
+int iuart_send_buffer(uint8_t port, const uint8_t *buf, uint16_t len);
+
+/* Sends up to IUART_TX_IOV segments, in RAM or flash, one after the
+ * other like iuart_send_buffer() does with one.  The segment array is
+ * copied and may go away on return, the data it points to may not.
+ * The done routine gets the first segment's base. */
+int iuart_writev(uint8_t port, const iuart_iovec_t *iov, uint8_t iovcnt);
+
+//Buffers handed over and not done yet; the oldest ones finish first
+uint8_t iuart_buffers_pending(uint8_t port);
+
+//Set a routine to be called as each buffer is done, or NULL for none
+void iuart_set_tx_done(uint8_t port, iuart_tx_done_t done);
+#endif
+
+#if IUART_TX_PRIO
+/* Queue output from interrupt context, e.g. diagnostics from a timer
+ * ISR, in the IUART_TX_PRIO ring, which is sent ahead of the output
+ * buffer.  Lock-free: never waits and masks no interrupts.  Only call
+ * with interrupts disabled, as they are in an ISR; all of interrupt
+ * context counts as the ring's single producer.  Returns 0, or EOF if
+ * the ring had no room; iuart_try_write() queues all of buf or none. */
+int iuart_try_putc(uint8_t port, char c);
+int iuart_try_write(uint8_t port, const uint8_t *buf, uint8_t len);
+#endif
+
+#if IUART_FRAMES
+//Receive frames (IUART_FRAME_SLIP, IUART_FRAME_RTU) instead of handing bytes out one by one (IUART_FRAME_OFF)
+void iuart_set_frame_mode(uint8_t port, uint8_t mode);
+
+//Length of the next completed frame, or -1 if there is none yet
+int16_t iuart_frame_len(uint8_t port);
+
+/* Copies the next completed frame into buf and releases it.  Bytes
+ * beyond size are dropped; buf may be NULL to just discard the frame.
+ * Returns the full length of the frame, or -1 if there is none yet. */
+int16_t iuart_frame_read(uint8_t port, uint8_t *buf, size_t size);
+
+//Queue a block as one frame in the port's frame mode, returns 0, or EOF if it was rejected
+int iuart_frame_send(uint8_t port, const uint8_t *buf, size_t len);
+#endif
+
+#if IUART_CRC
+//Add one byte to a CRC started at IUART_CRC_INIT, the same way the driver does
+iuart_crc_t iuart_crc_update(iuart_crc_t crc, uint8_t c);
+
+//CRC of the bytes accepted by iuart_write() since the last iuart_tx_crc_reset()
+iuart_crc_t iuart_tx_crc(uint8_t port);
+
+//Start the iuart_write() CRC over at IUART_CRC_INIT
+void iuart_tx_crc_reset(uint8_t port);
+#endif
+
+/* stdio hooks for any port: the port number is taken from the stream's
+ * user data, e.g. fdev_set_udata(&stream, (void *)1) for USART1. */
+int iuart_putchar(char c, FILE *stream);
+int iuart_getchar(FILE *stream);
+
 //Putchar function to attend the printing function call
 int UART0_Putchar(char c, FILE *stream);
 
+//Queue a block of raw bytes for transmission, returns how many were accepted
+size_t UART0_Write(const uint8_t *buf, size_t len);
+
+//Fetch one raw byte from the receive buffer, returns EOF if it is empty
+int UART0_Getchar(void);
+
+//Number of bytes waiting in the receive buffer
+int UART0_RxAvailable(void);
+
 /* Receive one character from the UART.  The actual reception is
  * line-buffered, and one character is returned from the buffer at
  * each invokation. */
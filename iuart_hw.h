@@ -0,0 +1,244 @@
+/*
+** @file iuart_hw.h
+*/
+
+/*	Hardware access for the interrupt driven UART.
+
+	On the target this just pulls in the avr-libc headers. Built with
+	IUART_HOST defined, e.g. with the host's gcc, it maps every register
+	the driver touches onto plain variables instead, so iuart.c can run
+	off-target: a harness stores a byte in UDRn and calls the RX vector,
+	or watches UDRIE0 and calls the UDRE vector to collect output. The
+	variables are defined in host/iuart_host.c; the harness supplies
+	iuart_host_sleep() and iuart_host_set_sreg(), see host/iuart_sim.c. */
+
+
+#ifndef _IUART_HW_H_
+#define _IUART_HW_H_
+
+#include <stdint.h>
+
+#if !defined (IUART_HOST)
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+
+#else	/* IUART_HOST */
+
+#include <stdio.h>
+#include <string.h>
+
+#define _BV(bit)					(1 << (bit))
+
+// USARTn register blocks, laid out like on the target: UCSRnA, UCSRnB,
+// UCSRnC, reserved, UBRRnL, UBRRnH, UDRn. Each UDRn is a single variable,
+// the harness models the receive FIFO and the shift register itself.
+extern volatile uint8_t iuart_host_usart[4][8];
+
+#define UCSR0A						iuart_host_usart[0][0]
+#define UCSR0B						iuart_host_usart[0][1]
+#define UCSR0C						iuart_host_usart[0][2]
+#define UBRR0L						iuart_host_usart[0][4]
+#define UBRR0H						iuart_host_usart[0][5]
+#define UDR0						iuart_host_usart[0][6]
+#define UCSR1A						iuart_host_usart[1][0]
+#define UCSR1B						iuart_host_usart[1][1]
+#define UCSR1C						iuart_host_usart[1][2]
+#define UBRR1L						iuart_host_usart[1][4]
+#define UBRR1H						iuart_host_usart[1][5]
+#define UDR1						iuart_host_usart[1][6]
+#define UCSR2A						iuart_host_usart[2][0]
+#define UCSR2B						iuart_host_usart[2][1]
+#define UCSR2C						iuart_host_usart[2][2]
+#define UBRR2L						iuart_host_usart[2][4]
+#define UBRR2H						iuart_host_usart[2][5]
+#define UDR2						iuart_host_usart[2][6]
+#define UCSR3A						iuart_host_usart[3][0]
+#define UCSR3B						iuart_host_usart[3][1]
+#define UCSR3C						iuart_host_usart[3][2]
+#define UBRR3L						iuart_host_usart[3][4]
+#define UBRR3H						iuart_host_usart[3][5]
+#define UDR3						iuart_host_usart[3][6]
+
+// UCSRnA
+#define RXC0						7
+#define TXC0						6
+#define UDRE0						5
+#define FE0							4
+#define DOR0						3
+#define UPE0						2
+#define U2X0						1
+#define MPCM0						0
+// UCSRnB
+#define RXCIE0						7
+#define TXCIE0						6
+#define UDRIE0						5
+#define RXEN0						4
+#define TXEN0						3
+#define UCSZ02						2
+#define RXB80						1
+#define TXB80						0
+// UCSRnC
+#define UMSEL01						7
+#define UMSEL00						6
+#define UPM01						5
+#define UPM00						4
+#define USBS0						3
+#define UCSZ01						2
+#define UCSZ00						1
+#define UCPOL0						0
+
+// GPIO ports and pin change interrupts, for the pins a build assigns to the
+// driver (flow control, instrumentation probe, ...)
+extern volatile uint8_t iuart_host_gpio[3][3];
+extern volatile uint8_t iuart_host_pcicr, iuart_host_pcmsk[3];
+
+#define PINB						iuart_host_gpio[0][0]
+#define DDRB						iuart_host_gpio[0][1]
+#define PORTB						iuart_host_gpio[0][2]
+#define PINC						iuart_host_gpio[1][0]
+#define DDRC						iuart_host_gpio[1][1]
+#define PORTC						iuart_host_gpio[1][2]
+#define PIND						iuart_host_gpio[2][0]
+#define DDRD						iuart_host_gpio[2][1]
+#define PORTD						iuart_host_gpio[2][2]
+
+#define PCICR						iuart_host_pcicr
+#define PCIE0						0
+#define PCIE1						1
+#define PCIE2						2
+#define PCMSK0						iuart_host_pcmsk[0]
+#define PCMSK1						iuart_host_pcmsk[1]
+#define PCMSK2						iuart_host_pcmsk[2]
+#define PCINT0_vect					iuart_host_pcint0_vect
+#define PCINT1_vect					iuart_host_pcint1_vect
+#define PCINT2_vect					iuart_host_pcint2_vect
+
+// Timer1, which the harness advances to model the passage of time
+extern volatile uint8_t iuart_host_tccr1a, iuart_host_tccr1b;
+extern volatile uint8_t iuart_host_timsk1, iuart_host_tifr1;
+extern volatile uint16_t iuart_host_tcnt1, iuart_host_ocr1b, iuart_host_icr1;
+
+#define TCCR1A						iuart_host_tccr1a
+#define TCCR1B						iuart_host_tccr1b
+#define TCNT1						iuart_host_tcnt1
+#define OCR1B						iuart_host_ocr1b
+#define ICR1						iuart_host_icr1
+#define TIMSK1						iuart_host_timsk1
+#define TIFR1						iuart_host_tifr1
+#define CS10						0
+#define CS11						1
+#define CS12						2
+#define ICNC1						7
+#define ICES1						6
+#define TOIE1						0
+#define OCIE1B						2
+#define ICIE1						5
+#define TOV1						0
+#define OCF1B						2
+#define ICF1						5
+#define TIMER1_CAPT_vect			iuart_host_timer1_capt_vect
+#define TIMER1_COMPB_vect			iuart_host_timer1_compb_vect
+#define TIMER1_OVF_vect				iuart_host_timer1_ovf_vect
+
+// Global interrupt flag. The driver only reads SREG and changes it through
+// the harness, which runs the interrupts left pending once the flag is set
+// again and can time how long it stayed clear.
+extern volatile uint8_t iuart_host_sreg;
+void iuart_host_set_sreg(uint8_t sreg);
+
+#define SREG						iuart_host_sreg
+#define SREG_I						7
+#define cli()						iuart_host_set_sreg(SREG & ~_BV(SREG_I))
+#define sei()						iuart_host_set_sreg(SREG | _BV(SREG_I))
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type)															\
+	for (uint8_t iuart_host_sreg_save = SREG, iuart_host_once = (cli(), 1);		\
+	     iuart_host_once; iuart_host_set_sreg(iuart_host_sreg_save), iuart_host_once = 0)
+
+// Interrupt vectors become plain functions the harness calls
+#define ISR(vector, ...)			void vector(void); void vector(void)
+
+#define USART0_RX_vect				iuart_host_usart0_rx_vect
+#define USART0_UDRE_vect			iuart_host_usart0_udre_vect
+#define USART0_TX_vect				iuart_host_usart0_tx_vect
+#define USART1_RX_vect				iuart_host_usart1_rx_vect
+#define USART1_UDRE_vect			iuart_host_usart1_udre_vect
+#define USART1_TX_vect				iuart_host_usart1_tx_vect
+#define USART2_RX_vect				iuart_host_usart2_rx_vect
+#define USART2_UDRE_vect			iuart_host_usart2_udre_vect
+#define USART2_TX_vect				iuart_host_usart2_tx_vect
+#define USART3_RX_vect				iuart_host_usart3_rx_vect
+#define USART3_UDRE_vect			iuart_host_usart3_udre_vect
+#define USART3_TX_vect				iuart_host_usart3_tx_vect
+
+// Sleeping hands control to the harness, which should let some simulated
+// time pass and run the interrupts that would have woken the CPU up. SMCR
+// only keeps the sleep mode selected, as set_sleep_mode() does on the target.
+extern volatile uint8_t iuart_host_smcr;
+void iuart_host_sleep(void);
+
+#define SMCR						iuart_host_smcr
+#define SE							0
+#define SM0							1
+#define SM1							2
+#define SM2							3
+#define SLEEP_MODE_IDLE				0
+#define SLEEP_MODE_PWR_DOWN			_BV(SM1)
+#define set_sleep_mode(mode)		\
+	(SMCR = (SMCR & ~(_BV(SM0) | _BV(SM1) | _BV(SM2))) | (mode))
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu()					iuart_host_sleep()
+#define sleep_mode()				iuart_host_sleep()
+
+// Flash is ordinary memory
+#define PROGMEM
+#define PGM_P						const char *
+#define PSTR(s)						(s)
+#define pgm_read_byte(addr)			(*(const uint8_t *)(addr))
+#define pgm_read_word(addr)			(*(const uint16_t *)(addr))
+#define memcpy_P					memcpy
+#define strlen_P					strlen
+
+// The avr-libc <util/crc16.h> routines, as documented there
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t a)
+{
+	uint8_t i;
+
+	crc ^= a;
+	for (i = 0; i < 8; ++i)
+		crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : (crc >> 1);
+	return crc;
+}
+
+static inline uint8_t _crc8_ccitt_update(uint8_t inCrc, uint8_t inData)
+{
+	uint8_t i, data;
+
+	data = inCrc ^ inData;
+	for (i = 0; i < 8; i++)
+		data = (data & 0x80) ? (data << 1) ^ 0x07 : (data << 1);
+	return data;
+}
+
+// avr-libc stdio extensions. The host FILE has no user data, so it is kept
+// in a small table instead, for up to IUART_HOST_STREAMS streams.
+#define _FDEV_ERR					(-1)
+#define _FDEV_EOF					(-2)
+#define IUART_HOST_STREAMS			4
+
+void *iuart_host_get_udata(FILE *stream);
+void iuart_host_set_udata(FILE *stream, void *udata);
+
+#define fdev_get_udata(stream)		iuart_host_get_udata(stream)
+#define fdev_set_udata(stream, u)	iuart_host_set_udata(stream, u)
+
+#endif	/* IUART_HOST */
+
+#endif 	    /* !_IUART_HW_H_ */
@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+"""Turns the records of iuart_log() back into text.
+
+usage: iuart_log.py firmware.bin [capture]
+
+firmware.bin is the flash image of the firmware that sent the records,
+for instance from
+
+    avr-objcopy -O binary -R .eeprom firmware.elf firmware.bin
+
+and capture a file or a serial device (set up with stty beforehand)
+holding the output of the port, standard input by default.
+
+Every SLIP frame is one record: the flash address of the format, 16 bits
+little-endian, then the arguments the way iuart_vlog() encodes them. The
+format is read from the image at that address, so the image must be the
+one the target runs; records that don't fit their format are reported
+on standard error and skipped.
+"""
+
+import os
+import struct
+import sys
+
+SLIP_END = 0xC0
+SLIP_ESC = 0xDB
+SLIP_ESC_END = 0xDC
+SLIP_ESC_ESC = 0xDD
+
+FLAGS = "0123456789-+ #."
+
+
+def slip_frames(fd):
+    """Yields the non-empty SLIP frames read from a file descriptor."""
+    frame = bytearray()
+    esc = False
+    bad = False
+    while True:
+        chunk = os.read(fd, 256)
+        if not chunk:
+            return
+        for b in chunk:
+            if b == SLIP_END:
+                if frame and not bad and not esc:
+                    yield bytes(frame)
+                frame = bytearray()
+                esc = bad = False
+            elif esc:
+                esc = False
+                if b == SLIP_ESC_END:
+                    frame.append(SLIP_END)
+                elif b == SLIP_ESC_ESC:
+                    frame.append(SLIP_ESC)
+                else:
+                    bad = True
+            elif b == SLIP_ESC:
+                esc = True
+            else:
+                frame.append(b)
+
+
+def flash_string(image, addr):
+    """The NUL terminated string at addr in the flash image."""
+    end = image.find(b"\0", addr)
+    if addr >= len(image) or end < 0:
+        raise ValueError("no format at 0x%04x" % addr)
+    return image[addr:end].decode("latin-1")
+
+
+class Args:
+    """Takes the arguments out of a record, in order."""
+
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def take(self, fmt):
+        try:
+            (v,) = struct.unpack_from(fmt, self.data, self.pos)
+        except struct.error:
+            raise ValueError("record too short")
+        self.pos += struct.calcsize(fmt)
+        return v
+
+    def string(self):
+        end = self.data.find(b"\0", self.pos)
+        if end < 0:
+            raise ValueError("unterminated string")
+        s = self.data[self.pos:end].decode("latin-1")
+        self.pos = end + 1
+        return s
+
+
+def render(fmt, args):
+    """Formats one record, scanning fmt the same way iuart_vlog() does."""
+    out = []
+    i = 0
+    while i < len(fmt):
+        c = fmt[i]
+        i += 1
+        if c != "%":
+            out.append(c)
+            continue
+
+        spec = "%"
+        values = []
+        is_long = False
+        c = ""
+        while i < len(fmt):
+            c = fmt[i]
+            i += 1
+            if c == "*":
+                spec += "*"
+                values.append(args.take("<h"))
+            elif c == "l":
+                is_long = True
+            elif c == "h":
+                pass
+            elif c in FLAGS:
+                spec += c
+            else:
+                break
+            c = ""
+
+        if c in ("s", "S"):
+            out.append((spec + "s") % tuple(values + [args.string()]))
+        elif c == "c":
+            out.append((spec + "c") % tuple(values + [chr(args.take("<B"))]))
+        elif c in "eEfFgG" and c:
+            out.append((spec + c) % tuple(values + [args.take("<f")]))
+        elif c == "p":
+            out.append("0x%04x" % args.take("<H"))
+        elif c in ("d", "i"):
+            out.append((spec + "d") % tuple(values + [args.take("<l" if is_long else "<h")]))
+        elif c in ("u", "x", "X", "o"):
+            conv = "d" if c == "u" else c
+            out.append((spec + conv) % tuple(values + [args.take("<L" if is_long else "<H")]))
+        elif c == "%":
+            out.append("%")
+        else:
+            out.append("%" + c)         # unknown, the target took no argument
+
+    if args.pos != len(args.data):
+        raise ValueError("record too long")
+    return "".join(out)
+
+
+def decode(image, record):
+    if len(record) < 2:
+        raise ValueError("record too short")
+    (addr,) = struct.unpack_from("<H", record)
+    return render(flash_string(image, addr), Args(record[2:]))
+
+
+def main(argv):
+    if len(argv) not in (2, 3):
+        sys.stderr.write(__doc__)
+        return 2
+
+    with open(argv[1], "rb") as f:
+        image = f.read()
+    fd = os.open(argv[2], os.O_RDONLY) if len(argv) == 3 else sys.stdin.fileno()
+
+    for record in slip_frames(fd):
+        try:
+            text = decode(image, record)
+        except ValueError as e:
+            sys.stderr.write("iuart_log: %s: %s\n" % (e, record.hex()))
+            continue
+        sys.stdout.write(text)
+        sys.stdout.flush()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))